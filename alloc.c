@@ -1,70 +1,121 @@
 #include "alloc.h"
 
+#include <limits.h>
 #include <stddef.h>
 #include <stdlib.h>
 
-#define START_CAP_ITEMS 16
-#define GROWTH_FACTOR 2
-
+/*
+ * Make room for 'n' more rows in parallel arrays of 32 bit columns. The columns share
+ * 'cap', which is only changed once all of them have grown.
+ */
 static bool
-cap_grow(void ** data, unsigned sz_elem, unsigned size, unsigned * cap) {
-    if (*data == NULL) {
-        *cap = START_CAP_ITEMS;
-        *data = malloc(*cap * sz_elem);
-    } else if (size > *cap) {
-        *cap = *cap * GROWTH_FACTOR;
-        *data = realloc(*data, *cap * sz_elem);
+columns_reserve(uint32_t ** cols[], unsigned num_cols, unsigned size, unsigned * cap, unsigned n)
+{
+    if (n <= *cap - size)
+        return true;
+    if (n > UINT_MAX - size)
+        return false;
+
+    unsigned new_cap = array_grow_cap(*cap, size + n, sizeof(uint32_t));
+    if (new_cap == 0)
+        return false;
+
+    for (unsigned i = 0; i < num_cols; ++i) {
+        uint32_t * p = realloc(*cols[i], (size_t)new_cap * sizeof(uint32_t));
+        if (p == NULL)
+            return false;
+        *cols[i] = p;
     }
 
-    return data != NULL;
+    *cap = new_cap;
+    return true;
 }
 
-struct diff *
-alloc_diff(struct diff_array * a)
+static void
+columns_shrink(uint32_t ** cols[], unsigned num_cols, unsigned size, unsigned * cap)
 {
-    if (!cap_grow((void**)&a->data, sizeof(struct diff), a->size + 1, &a->cap))
-        return NULL;
-    struct diff * n = &a->data[a->size++];
-    *n = (struct diff) {0};
-    return n;
+    if (*cap <= size)
+        return;
+
+    for (unsigned i = 0; i < num_cols; ++i) {
+        if (size == 0) {
+            free(*cols[i]);
+            *cols[i] = NULL;
+            continue;
+        }
+
+        /* a column that can't shrink keeps its bigger block */
+        uint32_t * p = realloc(*cols[i], (size_t)size * sizeof(uint32_t));
+        if (p != NULL)
+            *cols[i] = p;
+    }
+
+    *cap = size;
 }
 
-struct hunk *
-alloc_hunk(struct hunk_array * a)
+static void
+columns_release(uint32_t ** cols[], unsigned num_cols, unsigned * size, unsigned * cap)
 {
-    if (!cap_grow((void**)&a->data, sizeof(struct hunk), a->size + 1, &a->cap))
-        return NULL;
-    struct hunk * c = &a->data[a->size++];
-    *c = (struct hunk) {0};
-    return c;
+    for (unsigned i = 0; i < num_cols; ++i) {
+        free(*cols[i]);
+        *cols[i] = NULL;
+    }
+
+    *size = 0;
+    *cap = 0;
 }
 
-struct hunk_line *
-alloc_hunk_line(struct hunk_line_array * a)
+bool
+hunk_line_array_reserve(struct hunk_line_array * a, unsigned n)
 {
-    if (!cap_grow((void**)&a->data, sizeof(struct hunk_line), a->size + 1, &a->cap))
-        return NULL;
-    struct hunk_line * n = &a->data[a->size++];
-    *n = (struct hunk_line) {0};
-    return n;
+    uint32_t ** cols[] = { &a->offset, &a->len_type };
+    return columns_reserve(cols, 2, a->size, &a->cap, n);
 }
 
-struct render_line *
-alloc_render_line(struct render_line_array * a)
+bool
+hunk_line_array_push(struct hunk_line_array * a, uint32_t offset, uint32_t len_type)
 {
-    if (!cap_grow((void**)&a->data, sizeof(struct render_line), a->size + 1, &a->cap))
-        return NULL;
-    struct render_line * n = &a->data[a->size++];
-    *n = (struct render_line) {0};
-    return n;
+    if (!hunk_line_array_reserve(a, 1))
+        return false;
+
+    a->offset[a->size] = offset;
+    a->len_type[a->size] = len_type;
+    a->size++;
+    return true;
+}
+
+void
+hunk_line_array_shrink(struct hunk_line_array * a)
+{
+    uint32_t ** cols[] = { &a->offset, &a->len_type };
+    columns_shrink(cols, 2, a->size, &a->cap);
+}
+
+void
+hunk_line_array_release(struct hunk_line_array * a)
+{
+    uint32_t ** cols[] = { &a->offset, &a->len_type };
+    columns_release(cols, 2, &a->size, &a->cap);
+}
+
+bool
+render_row_array_push(struct render_row_array * a, uint32_t line0, uint32_t line1,
+    uint32_t flags)
+{
+    uint32_t ** cols[] = { &a->line[0], &a->line[1], &a->flags };
+    if (!columns_reserve(cols, 3, a->size, &a->cap, 1))
+        return false;
+
+    a->line[0][a->size] = line0;
+    a->line[1][a->size] = line1;
+    a->flags[a->size] = flags;
+    a->size++;
+    return true;
 }
 
-struct render_line_pair *
-alloc_render_line_pair(struct render_line_pair_array * a)
+void
+render_row_array_release(struct render_row_array * a)
 {
-    if (!cap_grow((void**)&a->data, sizeof(struct render_line_pair), a->size + 1, &a->cap))
-        return NULL;
-    struct render_line_pair * n = &a->data[a->size++];
-    *n = (struct render_line_pair) {0};
-    return n;
+    uint32_t ** cols[] = { &a->line[0], &a->line[1], &a->flags };
+    columns_release(cols, 3, &a->size, &a->cap);
 }
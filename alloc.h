@@ -3,15 +3,24 @@
 
 #include "types.h"
 
-struct diff * alloc_diff(struct diff_array * a);
+/*
+ * The arrays of parallel columns. They grow and fail like the arrays of array.h, with
+ * every column growing together.
+ */
 
-struct hunk * alloc_hunk(struct hunk_array * a);
+bool hunk_line_array_reserve(struct hunk_line_array * a, unsigned n);
 
-struct hunk_line * alloc_hunk_line(struct hunk_line_array * a);
+bool hunk_line_array_push(struct hunk_line_array * a, uint32_t offset, uint32_t len_type);
 
-struct render_line * alloc_render_line(struct render_line_array * a);
+void hunk_line_array_shrink(struct hunk_line_array * a);
 
-struct render_line_pair * alloc_render_line_pair(struct render_line_pair_array * a);
+/* NOTE: Must not be called for lines that point into the mapped cache */
+void hunk_line_array_release(struct hunk_line_array * a);
+
+bool render_row_array_push(struct render_row_array * a, uint32_t line0, uint32_t line1,
+    uint32_t flags);
+
+void render_row_array_release(struct render_row_array * a);
 
 
 #endif
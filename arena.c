@@ -0,0 +1,111 @@
+#include "arena.h"
+
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_CHUNK_SIZE (4 * 1024)
+#define MAX_CHUNK_SIZE (1024 * 1024)
+
+struct arena_chunk {
+    struct arena_chunk * next;
+    size_t size;
+    size_t used;
+    alignas(max_align_t) char data[];
+};
+
+static struct arena_chunk *
+new_chunk(struct arena * a, size_t min_size)
+{
+    /* chunks grow with the arena, so small arenas stay small */
+    size_t size = a->head ? a->head->size * 2 : MIN_CHUNK_SIZE;
+    if (size > MAX_CHUNK_SIZE)
+        size = MAX_CHUNK_SIZE;
+    if (size < min_size)
+        size = min_size;
+
+    struct arena_chunk * c = malloc(sizeof(struct arena_chunk) + size);
+    if (c == NULL) {
+        fprintf(stderr, "malloc failed when growing arena to %zu bytes.\n",
+            a->bytes_reserved + size);
+        exit(EXIT_FAILURE);
+    }
+
+    c->next = a->head;
+    c->size = size;
+    c->used = 0;
+
+    a->head = c;
+    a->bytes_reserved += size;
+    return c;
+}
+
+static void *
+alloc_aligned(struct arena * a, size_t size, size_t align)
+{
+    struct arena_chunk * c = a->head;
+    size_t start = c ? (c->used + align - 1) & ~(align - 1) : 0;
+
+    if (c == NULL || start > c->size || c->size - start < size) {
+        c = new_chunk(a, size);
+        start = 0;
+    }
+
+    void * p = c->data + start;
+    a->bytes_used += start - c->used + size;
+    c->used = start + size;
+    return p;
+}
+
+void *
+arena_alloc(struct arena * a, size_t size)
+{
+    return alloc_aligned(a, size, alignof(max_align_t));
+}
+
+char *
+arena_strndup(struct arena * a, char const * s, size_t len)
+{
+    /* strings need no alignment */
+    char * n = alloc_aligned(a, len + 1, 1);
+    memcpy(n, s, len);
+    n[len] = '\0';
+    return n;
+}
+
+void
+arena_adopt(struct arena * dst, struct arena * src)
+{
+    if (src->head == NULL)
+        return;
+
+    /* put the chunks of src after the chunk dst currently allocates from */
+    struct arena_chunk * tail = src->head;
+    while (tail->next != NULL)
+        tail = tail->next;
+
+    if (dst->head == NULL) {
+        dst->head = src->head;
+    } else {
+        tail->next = dst->head->next;
+        dst->head->next = src->head;
+    }
+
+    dst->bytes_used += src->bytes_used;
+    dst->bytes_reserved += src->bytes_reserved;
+    *src = (struct arena) {0};
+}
+
+void
+arena_release(struct arena * a)
+{
+    struct arena_chunk * c = a->head;
+    while (c != NULL) {
+        struct arena_chunk * next = c->next;
+        free(c);
+        c = next;
+    }
+
+    *a = (struct arena) {0};
+}
@@ -0,0 +1,35 @@
+#ifndef _NADIFF_ARENA_H_
+#define _NADIFF_ARENA_H_
+
+#include <stddef.h>
+
+struct arena_chunk;
+
+/*
+ * A bump allocator. Memory is handed out from big chunks and can only be released all at
+ * once. Not thread safe, every arena has a single owner.
+ */
+struct arena {
+    struct arena_chunk * head;
+
+    /* bytes handed out and bytes allocated from the heap */
+    size_t bytes_used;
+    size_t bytes_reserved;
+};
+
+/* NOTE: This function will exit program if allocation fails. */
+void *
+arena_alloc(struct arena * a, size_t size);
+
+/* Copy len characters and add '\0' after them */
+char *
+arena_strndup(struct arena * a, char const * s, size_t len);
+
+/* Move all memory of 'src' to 'dst', which makes 'src' empty */
+void
+arena_adopt(struct arena * dst, struct arena * src);
+
+void
+arena_release(struct arena * a);
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef _NADIFF_ARRAY_H_
+#define _NADIFF_ARRAY_H_
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A growable array of 'type'. Any struct holding ARRAY_FIELDS gets these functions from
+ * ARRAY_FUNCTIONS(name, type), where 'name' is the struct tag:
+ *
+ *   name_reserve(a, n)  make room for n more elements, returns false if out of memory
+ *   name_push(a)        append a zeroed element, returns NULL if out of memory
+ *   name_shrink(a)      give back the capacity that is not used
+ *   name_release(a)     free the elements, which leaves an empty array
+ *
+ * When growing fails the array is left as it was.
+ */
+#define ARRAY_FIELDS(type) \
+    type * data;           \
+    unsigned size;         \
+    unsigned cap
+
+#define ARRAY_MIN_CAP 16
+
+/* The capacity to grow to for 'size' elements, or 0 if that is too many */
+static inline unsigned
+array_grow_cap(unsigned cap, unsigned size, size_t elem_size)
+{
+    /* at least double, so pushing one element at a time is amortized O(1) */
+    unsigned new_cap = cap < ARRAY_MIN_CAP ? ARRAY_MIN_CAP : cap;
+    while (new_cap < size)
+        new_cap = new_cap > UINT_MAX / 2 ? UINT_MAX : new_cap * 2;
+
+    if ((size_t)new_cap > SIZE_MAX / elem_size)
+        return 0;
+
+    return new_cap;
+}
+
+#define ARRAY_FUNCTIONS(name, type)                                                    \
+    static inline bool                                                                 \
+    name##_reserve(struct name * a, unsigned n)                                        \
+    {                                                                                  \
+        if (n <= a->cap - a->size)                                                     \
+            return true;                                                               \
+        if (n > UINT_MAX - a->size)                                                    \
+            return false;                                                              \
+                                                                                       \
+        unsigned cap = array_grow_cap(a->cap, a->size + n, sizeof(type));              \
+        if (cap == 0)                                                                  \
+            return false;                                                              \
+                                                                                       \
+        type * data = realloc(a->data, (size_t)cap * sizeof(type));                    \
+        if (data == NULL)                                                              \
+            return false;                                                              \
+                                                                                       \
+        a->data = data;                                                                \
+        a->cap = cap;                                                                  \
+        return true;                                                                   \
+    }                                                                                  \
+                                                                                       \
+    static inline type *                                                               \
+    name##_push(struct name * a)                                                       \
+    {                                                                                  \
+        if (!name##_reserve(a, 1))                                                     \
+            return NULL;                                                               \
+                                                                                       \
+        type * n = &a->data[a->size++];                                                \
+        memset(n, 0, sizeof(*n));                                                      \
+        return n;                                                                      \
+    }                                                                                  \
+                                                                                       \
+    static inline void                                                                 \
+    name##_shrink(struct name * a)                                                     \
+    {                                                                                  \
+        if (a->size == a->cap)                                                         \
+            return;                                                                    \
+                                                                                       \
+        if (a->size == 0) {                                                            \
+            free(a->data);                                                             \
+            a->data = NULL;                                                            \
+            a->cap = 0;                                                                \
+            return;                                                                    \
+        }                                                                              \
+                                                                                       \
+        /* keeping the bigger block is fine if the smaller one can't be had */         \
+        type * data = realloc(a->data, (size_t)a->size * sizeof(type));                \
+        if (data != NULL) {                                                            \
+            a->data = data;                                                            \
+            a->cap = a->size;                                                          \
+        }                                                                              \
+    }                                                                                  \
+                                                                                       \
+    static inline void                                                                 \
+    name##_release(struct name * a)                                                    \
+    {                                                                                  \
+        free(a->data);                                                                 \
+        a->data = NULL;                                                                \
+        a->size = 0;                                                                   \
+        a->cap = 0;                                                                    \
+    }
+
+#endif
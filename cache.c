@@ -0,0 +1,643 @@
+#define _GNU_SOURCE /* O_TMPFILE */
+#include "cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "alloc.h"
+#include "error.h"
+#include "hash.h"
+#include "parse.h"
+
+#define CACHE_MAGIC "NADIFFC"
+#define CACHE_VERSION 3
+#define CACHE_BYTE_ORDER 0x01020304u
+
+/* The cache directory is trimmed to this after a store */
+#define CACHE_MAX_SIZE ((uint64_t)1 << 30)
+
+struct cache_diff {
+    /* the range of the input holding the hunks */
+    uint64_t hunk_offset;
+    uint64_t hunk_size;
+
+    uint64_t first_hunk;
+    uint64_t first_line;
+    uint32_t num_hunks;
+    uint32_t num_lines;
+
+    /* offsets of '\0' terminated names in the strings section */
+    uint32_t pre_img_name;
+    uint32_t post_img_name;
+    uint32_t short_pre_img_name;
+    uint32_t short_post_img_name;
+
+    uint8_t status;
+    uint8_t expect_line_changes;
+    uint8_t has_hunks;
+    uint8_t pad[5];
+};
+
+struct cache_hunk {
+    uint32_t pre_line_nr;
+    uint32_t post_line_nr;
+    uint32_t pre_num_lines;
+    uint32_t post_num_lines;
+
+    /* relative to the hunk range of the diff */
+    uint32_t section_name;
+    uint32_t section_name_len;
+
+    /* relative to the first line of the diff */
+    uint32_t first_line;
+    uint32_t num_lines;
+};
+
+/* The sections of a cache file, in the order they are written */
+enum cache_section {
+    SECTION_DIFFS,
+    SECTION_HUNKS,
+    SECTION_LINE_OFFSETS,
+    SECTION_LINE_LEN_TYPES,
+    SECTION_STRINGS,
+    NUM_SECTIONS,
+};
+
+static const size_t section_elem_size[NUM_SECTIONS] = {
+    [SECTION_DIFFS] = sizeof(struct cache_diff),
+    [SECTION_HUNKS] = sizeof(struct cache_hunk),
+    [SECTION_LINE_OFFSETS] = sizeof(uint32_t),
+    [SECTION_LINE_LEN_TYPES] = sizeof(uint32_t),
+    [SECTION_STRINGS] = 1,
+};
+
+/*
+ * The layout of a cache file is the header followed by the sections, each starting at a
+ * multiple of 8 bytes. The hunk lines are stored the same way a diff keeps them, so they
+ * are used straight from the mapped file. Everything is in the byte order of the machine
+ * that wrote it.
+ */
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+
+    uint64_t input_size;
+    uint64_t input_hash;
+    uint64_t body_hash; /* of the sections */
+
+    uint64_t section_offset[NUM_SECTIONS];
+    uint64_t section_count[NUM_SECTIONS];
+};
+
+_Static_assert(sizeof(struct cache_header) % 8 == 0, "cache_header must keep sections aligned");
+
+/* The cache we loaded, it stays mapped since the diffs point into it */
+static struct cache_hunk const * cache_hunks = NULL;
+static uint32_t const * cache_line_offsets = NULL;
+static uint32_t const * cache_line_len_types = NULL;
+
+static bool
+cache_path(char * path, size_t size, uint64_t key, bool create_dir)
+{
+    char const * xdg = getenv("XDG_CACHE_HOME");
+    char const * home = getenv("HOME");
+
+    int len;
+    if (xdg != NULL && xdg[0] == '/')
+        len = snprintf(path, size, "%s/nadiff", xdg);
+    else if (home != NULL && home[0] == '/')
+        len = snprintf(path, size, "%s/.cache/nadiff", home);
+    else
+        return false;
+
+    if (len < 0 || (size_t)len >= size)
+        return false;
+
+    if (create_dir) {
+        /* create every missing directory on the way */
+        for (char * p = path + 1; *p != '\0'; ++p) {
+            if (*p != '/')
+                continue;
+
+            *p = '\0';
+            int ret = mkdir(path, 0700);
+            *p = '/';
+            if (ret != 0 && errno != EEXIST)
+                return false;
+        }
+
+        if (mkdir(path, 0700) != 0 && errno != EEXIST)
+            return false;
+    }
+
+    int n = snprintf(path + len, size - len, "/%016llx", (unsigned long long)key);
+    return n >= 0 && (size_t)n < size - len;
+}
+
+static uint64_t
+body_hash(void const * const data[NUM_SECTIONS], uint64_t const count[NUM_SECTIONS])
+{
+    uint64_t h[NUM_SECTIONS];
+    for (unsigned i = 0; i < NUM_SECTIONS; ++i)
+        h[i] = hash64(data[i], count[i] * section_elem_size[i], i);
+
+    return hash64(h, sizeof(h), 0);
+}
+
+static bool
+validate_header(struct cache_header const * h, size_t file_size, size_t input_size, uint64_t key)
+{
+    try_ret(memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) == 0);
+    try_ret(h->version == CACHE_VERSION && h->byte_order == CACHE_BYTE_ORDER);
+    try_ret(h->input_size == input_size && h->input_hash == key);
+
+    char const * base = (char const *)h;
+    void const * data[NUM_SECTIONS];
+    for (unsigned i = 0; i < NUM_SECTIONS; ++i) {
+        uint64_t offset = h->section_offset[i];
+        try_ret(offset % 8 == 0 && offset >= sizeof(*h) && offset <= file_size);
+        try_ret(h->section_count[i] <= (file_size - offset) / section_elem_size[i]);
+        data[i] = base + offset;
+    }
+
+    /* every name offset then points to a terminated string */
+    uint64_t strings_size = h->section_count[SECTION_STRINGS];
+    try_ret(strings_size > 0 && strings_size <= UINT32_MAX);
+    try_ret(base[h->section_offset[SECTION_STRINGS] + strings_size - 1] == '\0');
+
+    try_ret(h->section_count[SECTION_LINE_OFFSETS] == h->section_count[SECTION_LINE_LEN_TYPES]);
+
+    return body_hash(data, h->section_count) == h->body_hash;
+}
+
+/* The short name must be a suffix of the name */
+static bool
+is_short_name(char const * strings, uint32_t name, uint32_t short_name)
+{
+    return short_name >= name && short_name <= name + strlen(strings + name);
+}
+
+static bool
+load_diff(struct cache_header const * h, struct cache_diff const * cd, char const * data,
+          struct diff_array * da)
+{
+    char const * strings = (char const *)h + h->section_offset[SECTION_STRINGS];
+    uint64_t strings_size = h->section_count[SECTION_STRINGS];
+    uint64_t num_hunks = h->section_count[SECTION_HUNKS];
+    uint64_t num_lines = h->section_count[SECTION_LINE_OFFSETS];
+
+    try_ret(cd->pre_img_name < strings_size && cd->post_img_name < strings_size);
+    try_ret(is_short_name(strings, cd->pre_img_name, cd->short_pre_img_name));
+    try_ret(is_short_name(strings, cd->post_img_name, cd->short_post_img_name));
+    try_ret(cd->status <= DIFF_STATUS_COPIED);
+
+    /* the offsets of the lines of a diff are 32 bits */
+    try_ret(cd->hunk_offset <= h->input_size && cd->hunk_size <= h->input_size - cd->hunk_offset);
+    try_ret(cd->hunk_size <= UINT32_MAX);
+    try_ret(cd->first_hunk <= num_hunks && cd->num_hunks <= num_hunks - cd->first_hunk);
+    try_ret(cd->first_line <= num_lines && cd->num_lines <= num_lines - cd->first_line);
+
+    struct diff * d = diff_array_push(da);
+    if (d == NULL) {
+        fprintf(stderr, "Failed to allocate diff\n");
+        return false;
+    }
+
+    *d = (struct diff) {
+        .ha = {0},
+        .hla = {0},
+        .pre_img_name = strings + cd->pre_img_name,
+        .post_img_name = strings + cd->post_img_name,
+        .short_pre_img_name = strings + cd->short_pre_img_name,
+        .short_post_img_name = strings + cd->short_post_img_name,
+        .status = cd->status,
+        .expect_line_changes = cd->expect_line_changes,
+        .is_parsed = !cd->has_hunks,
+        .hunk_data = cd->has_hunks ? data + cd->hunk_offset : NULL,
+        .hunk_size = cd->has_hunks ? cd->hunk_size : 0,
+        .cached = cd->has_hunks ? cd : NULL,
+    };
+
+    return true;
+}
+
+bool
+cache_load(char const * data, size_t size, uint64_t key, struct diff_array * da)
+{
+    char path[PATH_MAX];
+    if (!cache_path(path, sizeof(path), key, false))
+        return false;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct cache_header)) {
+        close(fd);
+        fprintf(stderr, "Ignoring corrupt cache %s\n", path);
+        return false;
+    }
+
+    void * p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Failed to map cache %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    struct cache_header const * h = p;
+    char const * base = p;
+    bool ok = validate_header(h, st.st_size, size, key);
+
+    if (ok && !diff_array_reserve(da, h->section_count[SECTION_DIFFS])) {
+        fprintf(stderr, "Failed to allocate diffs\n");
+        ok = false;
+    }
+
+    if (ok) {
+        struct cache_diff const * diffs =
+            (struct cache_diff const *)(base + h->section_offset[SECTION_DIFFS]);
+        for (uint64_t i = 0; ok && i < h->section_count[SECTION_DIFFS]; ++i)
+            ok = load_diff(h, &diffs[i], data, da);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Ignoring stale or corrupt cache %s\n", path);
+        munmap(p, st.st_size);
+        return false;
+    }
+
+    /* a cache that is used is kept longest when the directory is trimmed */
+    utimensat(AT_FDCWD, path, NULL, 0);
+
+    cache_hunks = (struct cache_hunk const *)(base + h->section_offset[SECTION_HUNKS]);
+    cache_line_offsets = (uint32_t const *)(base + h->section_offset[SECTION_LINE_OFFSETS]);
+    cache_line_len_types = (uint32_t const *)(base + h->section_offset[SECTION_LINE_LEN_TYPES]);
+    return true;
+}
+
+bool
+cache_load_hunks(struct diff * d)
+{
+    struct cache_diff const * cd = d->cached;
+
+    if (!hunk_array_reserve(&d->ha, cd->num_hunks)) {
+        fprintf(stderr, "Failed to allocate hunks\n");
+        return false;
+    }
+
+    /* the lines are used as they are in the mapped file, which is why 'cap' is 0 */
+    d->hla = (struct hunk_line_array) {
+        .offset = (uint32_t *)(cache_line_offsets + cd->first_line),
+        .len_type = (uint32_t *)(cache_line_len_types + cd->first_line),
+        .size = cd->num_lines,
+        .cap = 0,
+    };
+
+    for (unsigned i = 0; i < d->hla.size; ++i) {
+        unsigned len = hunk_line_len(&d->hla, i);
+        if (hunk_line_type(&d->hla, i) > NEUTRAL_LINE || len > d->hunk_size ||
+            d->hla.offset[i] > d->hunk_size - len)
+            goto corrupt;
+    }
+
+    for (uint64_t i = cd->first_hunk; i < cd->first_hunk + cd->num_hunks; ++i) {
+        struct cache_hunk const * ch = &cache_hunks[i];
+        if (ch->section_name_len > d->hunk_size ||
+            ch->section_name > d->hunk_size - ch->section_name_len ||
+            ch->first_line > cd->num_lines ||
+            ch->num_lines > cd->num_lines - ch->first_line)
+            goto corrupt;
+
+        struct hunk * h = hunk_array_push(&d->ha);
+
+        *h = (struct hunk) {
+            .pre_line_nr = ch->pre_line_nr,
+            .pre_num_lines = ch->pre_num_lines,
+            .post_line_nr = ch->post_line_nr,
+            .post_num_lines = ch->post_num_lines,
+            .section_name = ch->section_name_len ? d->hunk_data + ch->section_name : NULL,
+            .section_name_len = ch->section_name_len,
+            .first_line = ch->first_line,
+            .num_lines = ch->num_lines,
+        };
+    }
+
+    d->is_parsed = true;
+    return true;
+
+corrupt:
+    fprintf(stderr, "Corrupt cache entry for %s\n", d->post_img_name);
+    d->hla = (struct hunk_line_array) {0};
+    return false;
+}
+
+/* A growing buffer for a section of the cache file */
+struct cache_buf {
+    char * data;
+    size_t size;
+    size_t cap;
+};
+
+static bool
+buf_append(struct cache_buf * b, void const * p, size_t n)
+{
+    if (n == 0)
+        return true;
+
+    if (b->size + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->size + n)
+            cap *= 2;
+
+        char * data = realloc(b->data, cap);
+        if (data == NULL) {
+            fprintf(stderr, "Failed to allocate cache buffer\n");
+            return false;
+        }
+
+        b->data = data;
+        b->cap = cap;
+    }
+
+    memcpy(b->data + b->size, p, n);
+    b->size += n;
+    return true;
+}
+
+static bool
+append_string(struct cache_buf * strings, char const * s, uint32_t * offset)
+{
+    if (strings->size > UINT32_MAX)
+        return false;
+
+    *offset = strings->size;
+    return buf_append(strings, s, strlen(s) + 1);
+}
+
+static void
+free_hunks(struct diff * d)
+{
+    hunk_array_release(&d->ha);
+    hunk_line_array_release(&d->hla);
+}
+
+static bool
+store_hunks(struct diff const * d, struct cache_diff * cd, struct cache_buf bufs[NUM_SECTIONS])
+{
+    cd->first_hunk = bufs[SECTION_HUNKS].size / sizeof(struct cache_hunk);
+    cd->num_hunks = d->ha.size;
+    cd->first_line = bufs[SECTION_LINE_OFFSETS].size / sizeof(uint32_t);
+    cd->num_lines = d->hla.size;
+
+    for (unsigned i = 0; i < d->ha.size; ++i) {
+        struct hunk const * h = &d->ha.data[i];
+
+        struct cache_hunk ch = {
+            .pre_line_nr = h->pre_line_nr,
+            .post_line_nr = h->post_line_nr,
+            .pre_num_lines = h->pre_num_lines,
+            .post_num_lines = h->post_num_lines,
+            .section_name = h->section_name ? h->section_name - d->hunk_data : 0,
+            .section_name_len = h->section_name_len,
+            .first_line = h->first_line,
+            .num_lines = h->num_lines,
+        };
+        try_ret(buf_append(&bufs[SECTION_HUNKS], &ch, sizeof(ch)));
+    }
+
+    size_t lines_size = d->hla.size * sizeof(uint32_t);
+    try_ret(buf_append(&bufs[SECTION_LINE_OFFSETS], d->hla.offset, lines_size));
+    return buf_append(&bufs[SECTION_LINE_LEN_TYPES], d->hla.len_type, lines_size);
+}
+
+static bool
+store_diff(char const * data, struct diff * d, struct cache_buf bufs[NUM_SECTIONS])
+{
+    struct cache_diff cd = {
+        .status = d->status,
+        .expect_line_changes = d->expect_line_changes,
+        .has_hunks = !d->is_parsed,
+    };
+
+    struct cache_buf * strings = &bufs[SECTION_STRINGS];
+    try_ret(append_string(strings, d->pre_img_name, &cd.pre_img_name));
+    try_ret(append_string(strings, d->post_img_name, &cd.post_img_name));
+    cd.short_pre_img_name = cd.pre_img_name + (d->short_pre_img_name - d->pre_img_name);
+    cd.short_post_img_name = cd.post_img_name + (d->short_post_img_name - d->post_img_name);
+
+    if (cd.has_hunks) {
+        cd.hunk_offset = d->hunk_data - data;
+        cd.hunk_size = d->hunk_size;
+
+        bool ok = parse_diff_hunks(d) && store_hunks(d, &cd, bufs);
+        free_hunks(d);
+        try_ret(ok);
+    }
+
+    return buf_append(&bufs[SECTION_DIFFS], &cd, sizeof(cd));
+}
+
+/*
+ * The file is written without a name and only linked into the cache directory once it is
+ * complete, so quitting while it is written leaves nothing behind and readers only ever
+ * see a complete file.
+ */
+static bool
+write_file(char const * path, struct cache_header const * h,
+           struct cache_buf const bufs[NUM_SECTIONS])
+{
+    char dir[PATH_MAX];
+    char const * slash = strrchr(path, '/');
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+
+    int fd = open(dir, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return false;
+
+    FILE * f = fdopen(fd, "wb");
+    if (f == NULL) {
+        close(fd);
+        return false;
+    }
+
+    static const char padding[8] = {0};
+    bool ok = fwrite(h, sizeof(*h), 1, f) == 1;
+    for (unsigned i = 0; ok && i < NUM_SECTIONS; ++i) {
+        size_t size = bufs[i].size;
+        ok = size == 0 || fwrite(bufs[i].data, size, 1, f) == 1;
+        if (ok && size % 8 != 0)
+            ok = fwrite(padding, 8 - size % 8, 1, f) == 1;
+    }
+    ok = fflush(f) == 0 && ok;
+
+    if (ok) {
+        char fd_path[64];
+        char tmp_path[PATH_MAX + 32];
+        snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+        snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid());
+
+        ok = linkat(AT_FDCWD, fd_path, AT_FDCWD, tmp_path, AT_SYMLINK_FOLLOW) == 0;
+        if (ok && rename(tmp_path, path) != 0) {
+            unlink(tmp_path);
+            ok = false;
+        }
+    }
+
+    return fclose(f) == 0 && ok;
+}
+
+struct cache_entry {
+    char name[17];
+    struct timespec mtime;
+    uint64_t size;
+};
+
+/* A file named by cache_path(), not a file being written or anything else */
+static bool
+is_cache_name(char const * name)
+{
+    if (strlen(name) != 16)
+        return false;
+
+    for (unsigned i = 0; i < 16; ++i) {
+        if (!((name[i] >= '0' && name[i] <= '9') || (name[i] >= 'a' && name[i] <= 'f')))
+            return false;
+    }
+
+    return true;
+}
+
+static int
+compare_newest_first(void const * a, void const * b)
+{
+    struct timespec const * ta = &((struct cache_entry const *)a)->mtime;
+    struct timespec const * tb = &((struct cache_entry const *)b)->mtime;
+
+    if (ta->tv_sec != tb->tv_sec)
+        return ta->tv_sec < tb->tv_sec ? 1 : -1;
+    if (ta->tv_nsec != tb->tv_nsec)
+        return ta->tv_nsec < tb->tv_nsec ? 1 : -1;
+    return 0;
+}
+
+/*
+ * Remove the least recently used cache files until the rest fit in CACHE_MAX_SIZE. The one
+ * just stored at 'path' is always kept. Failing to trim is not an error.
+ */
+static void
+trim_cache(char const * path)
+{
+    char dir[PATH_MAX];
+    char const * slash = strrchr(path, '/');
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+
+    DIR * d = opendir(dir);
+    if (d == NULL)
+        return;
+
+    struct cache_entry * entries = NULL;
+    size_t num_entries = 0;
+    size_t cap = 0;
+    uint64_t kept = 0;
+
+    struct dirent * e;
+    while ((e = readdir(d)) != NULL) {
+        struct stat st;
+        if (!is_cache_name(e->d_name) || fstatat(dirfd(d), e->d_name, &st, 0) != 0
+                || !S_ISREG(st.st_mode))
+            continue;
+
+        if (strcmp(e->d_name, slash + 1) == 0) {
+            kept += st.st_size;
+            continue;
+        }
+
+        if (num_entries == cap) {
+            size_t new_cap = cap ? cap * 2 : 16;
+            struct cache_entry * p = realloc(entries, new_cap * sizeof(*p));
+            if (p == NULL)
+                break;
+            entries = p;
+            cap = new_cap;
+        }
+
+        struct cache_entry * c = &entries[num_entries++];
+        memcpy(c->name, e->d_name, sizeof(c->name));
+        c->mtime = st.st_mtim;
+        c->size = st.st_size;
+    }
+
+    if (num_entries > 0)
+        qsort(entries, num_entries, sizeof(*entries), compare_newest_first);
+
+    for (size_t i = 0; i < num_entries; ++i) {
+        if (kept + entries[i].size > CACHE_MAX_SIZE)
+            unlinkat(dirfd(d), entries[i].name, 0);
+        else
+            kept += entries[i].size;
+    }
+
+    free(entries);
+    closedir(d);
+}
+
+bool
+cache_store(char const * data, size_t size, uint64_t key, struct diff * diffs,
+            unsigned num_diffs)
+{
+    char path[PATH_MAX];
+    if (!cache_path(path, sizeof(path), key, true)) {
+        fprintf(stderr, "Failed to create the cache directory\n");
+        return false;
+    }
+
+    struct cache_buf bufs[NUM_SECTIONS] = {{0}};
+
+    bool ok = true;
+    for (unsigned i = 0; ok && i < num_diffs; ++i)
+        ok = store_diff(data, &diffs[i], bufs);
+
+    if (ok) {
+        struct cache_header h = {
+            .magic = CACHE_MAGIC,
+            .version = CACHE_VERSION,
+            .byte_order = CACHE_BYTE_ORDER,
+            .input_size = size,
+            .input_hash = key,
+        };
+
+        void const * sections[NUM_SECTIONS];
+        uint64_t offset = sizeof(h);
+        for (unsigned i = 0; i < NUM_SECTIONS; ++i) {
+            h.section_offset[i] = offset;
+            h.section_count[i] = bufs[i].size / section_elem_size[i];
+            sections[i] = bufs[i].data;
+            offset += (bufs[i].size + 7) / 8 * 8;
+        }
+        h.body_hash = body_hash(sections, h.section_count);
+
+        ok = write_file(path, &h, bufs);
+        if (ok)
+            trim_cache(path);
+        else
+            fprintf(stderr, "Failed to write cache %s: %s\n", path, strerror(errno));
+    } else {
+        fprintf(stderr, "Failed to cache the parsed diffs\n");
+    }
+
+    for (unsigned i = 0; i < NUM_SECTIONS; ++i)
+        free(bufs[i].data);
+
+    return ok;
+}
@@ -0,0 +1,36 @@
+#ifndef _NADIFF_CACHE_H_
+#define _NADIFF_CACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "types.h"
+
+/*
+ * An on-disk cache of parsed diffs, stored in $XDG_CACHE_HOME/nadiff and keyed by a hash
+ * of the complete input. It holds the diffs with all their hunks and hunk lines as offsets
+ * into the input, so opening the same input again only maps and validates the cache.
+ * A cache file takes about 12 bytes per line of its input. After each store the least
+ * recently used files are removed until the directory is at most 1 GB.
+ */
+
+/*
+ * Append the diffs of the input to 'da'. Returns false if there is no cache for the input,
+ * or if it is stale or corrupt, in which case 'da' is left partially filled.
+ */
+bool
+cache_load(char const * data, size_t size, uint64_t key, struct diff_array * da);
+
+/* Read the hunks of a diff loaded from the cache */
+bool
+cache_load_hunks(struct diff * d);
+
+/*
+ * Write the cache of the input. The hunks of 'diffs' are parsed and released here, so
+ * they must not be shared with anyone else.
+ */
+bool
+cache_store(char const * data, size_t size, uint64_t key, struct diff * diffs,
+            unsigned num_diffs);
+
+#endif
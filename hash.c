@@ -0,0 +1,103 @@
+#include "hash.h"
+
+#include <string.h>
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t
+rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+read64(unsigned char const * p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t
+read32(unsigned char const * p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t
+round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t
+merge_round64(uint64_t acc, uint64_t val)
+{
+    acc ^= round64(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t
+hash64(void const * data, size_t size, uint64_t seed)
+{
+    unsigned char const * p = data;
+    unsigned char const * end = p + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        /* four independent lanes keep the multipliers busy */
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+
+        for (; end - p >= 32; p += 32) {
+            v1 = round64(v1, read64(p));
+            v2 = round64(v2, read64(p + 8));
+            v3 = round64(v3, read64(p + 16));
+            v4 = round64(v4, read64(p + 24));
+        }
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = merge_round64(h, v1);
+        h = merge_round64(h, v2);
+        h = merge_round64(h, v3);
+        h = merge_round64(h, v4);
+    } else {
+        h = seed + PRIME64_5;
+    }
+
+    h += size;
+
+    for (; end - p >= 8; p += 8) {
+        h ^= round64(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+
+    if (end - p >= 4) {
+        h ^= (uint64_t)read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+
+    for (; p < end; ++p) {
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
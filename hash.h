@@ -0,0 +1,11 @@
+#ifndef _NADIFF_HASH_H_
+#define _NADIFF_HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A fast non-cryptographic 64 bit hash (XXH64) */
+uint64_t
+hash64(void const * data, size_t size, uint64_t seed);
+
+#endif
@@ -1,52 +1,356 @@
+#define _GNU_SOURCE /* memrchr() */
 #include "io.h"
 
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define MAX_LINE_SIZE 4096
+/* How much address space we reserve for spooling a pipe, and how much we commit at a time */
+#define SPOOL_RESERVE_SIZE ((size_t)1 << (sizeof(size_t) == 8 ? 40 : 30))
+#define SPOOL_COMMIT_SIZE ((size_t)1 << 24)
 
-static char buf[MAX_LINE_SIZE];
-static struct line l;
-static bool use_prev_line = false;
-static unsigned row = 1;
+/* A diff header is a handful of lines and its hunks are usually skipped, don't split more */
+#define FIRST_BATCH_LINES 16
 
-struct line *
-stdin_read_line(void)
+static char const * input = NULL;
+static size_t input_size = 0;
+
+/* State of a spooled pipe. A mapped regular file is complete from the start. */
+static int spool_fd = -1;
+static char * spool = NULL;
+static size_t spool_reserved = 0;
+static size_t spool_committed = 0;
+static bool input_complete = true;
+
+/* Everything before this position consists of complete lines */
+static size_t lines_end = 0;
+
+/*
+ * The stdin reader marks where each diff it skips to starts and the lines before it, so
+ * line_row() only counts from there. The input before might be released and read as zeros.
+ * The lock is for a reader that marks while another thread reports an error.
+ */
+static pthread_mutex_t row_mark_lock = PTHREAD_MUTEX_INITIALIZER;
+static char const * row_mark = NULL;
+static size_t row_mark_lines = 0;
+
+static struct line_reader reader;
+
+static bool
+map_regular_file(int fd, size_t size)
 {
-    if (use_prev_line) {
-        use_prev_line = false;
-        return &l;
+    input_size = lines_end = size;
+
+    /* mmap does not accept a zero length mapping */
+    if (size == 0)
+        return true;
+
+    void * p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Failed to map stdin: %s\n", strerror(errno));
+        return false;
+    }
+
+    madvise(p, size, MADV_SEQUENTIAL);
+    input = p;
+    line_reader_init(&reader, input, size);
+    return true;
+}
+
+/*
+ * Reserve a big range of address space up front and commit it as the pipe delivers data.
+ * That way the buffer never moves and every view into it stays valid while we keep
+ * reading.
+ */
+static bool
+reserve_spool(int fd)
+{
+    size_t reserved = SPOOL_RESERVE_SIZE;
+    char * p = MAP_FAILED;
+    while (reserved >= SPOOL_COMMIT_SIZE) {
+        p = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p != MAP_FAILED)
+            break;
+        reserved /= 2;
+    }
+
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Failed to reserve memory for stdin: %s\n", strerror(errno));
+        return false;
+    }
+
+    spool_fd = fd;
+    spool = p;
+    spool_reserved = reserved;
+    input = p;
+    input_complete = false;
+    line_reader_init(&reader, input, 0);
+    return true;
+}
+
+/* Read whatever the pipe has for us. Errors are reported and treated as end of input. */
+static void
+spool_more(void)
+{
+    if (input_size == spool_committed) {
+        if (spool_committed == spool_reserved) {
+            fprintf(stderr, "Input is larger than %zu bytes\n", spool_reserved);
+            input_complete = true;
+            return;
+        }
+
+        if (mprotect(spool + spool_committed, SPOOL_COMMIT_SIZE, PROT_READ | PROT_WRITE) != 0) {
+            fprintf(stderr, "Failed to commit memory for stdin: %s\n", strerror(errno));
+            input_complete = true;
+            return;
+        }
+        spool_committed += SPOOL_COMMIT_SIZE;
+    }
+
+    ssize_t ret;
+    do {
+        ret = read(spool_fd, spool + input_size, spool_committed - input_size);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+        fprintf(stderr, "Failed to read stdin: %s\n", strerror(errno));
+
+    if (ret <= 0) {
+        input_complete = true;
+        lines_end = input_size;
+    } else {
+        char const * nl = memrchr(spool + input_size, '\n', ret);
+        input_size += ret;
+        if (nl)
+            lines_end = nl - spool + 1;
     }
 
-    l.row = row++;
-    l.len = 0;
-    l.data = NULL;
+    reader.end = input + lines_end;
+}
 
-    if (fgets(buf, sizeof(buf), stdin) == NULL)
-        return &l;
+static bool
+stdin_fill(struct line_reader * r)
+{
+    (void)r;
 
-    /* in case we can't read complete line */
-    buf[MAX_LINE_SIZE - 1] = '\0';
+    if (input_complete)
+        return false;
 
-    /* get the length of the buffer, i.e. how much we've read */
-    size_t buf_len = strlen(buf);
+    spool_more();
+    return true;
+}
 
-    /* replace '\n' with '\0' */
-    if (buf[buf_len - 1] == '\n')
-        buf[buf_len - 1] = '\0';
+bool
+stdin_map(void)
+{
+    int fd = fileno(stdin);
 
-    if (buf[buf_len - 1] == '\0') {
-        l.len = buf_len;
-        l.data = buf;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to stat stdin: %s\n", strerror(errno));
+        return false;
     }
 
-    return &l;
+    if (S_ISREG(st.st_mode))
+        return map_regular_file(fd, st.st_size);
+
+    if (!reserve_spool(fd))
+        return false;
+
+    reader.fill = stdin_fill;
+    return true;
+}
+
+struct line_reader *
+stdin_reader(void)
+{
+    return &reader;
+}
+
+void
+stdin_read_all(void)
+{
+    while (!input_complete)
+        spool_more();
+}
+
+bool
+stdin_get_all(char const ** data, size_t * size)
+{
+    if (!input_complete)
+        return false;
+
+    *data = input;
+    *size = input_size;
+    return true;
+}
+
+static unsigned
+count_lines(char const * p, char const * end)
+{
+    unsigned n = 0;
+    while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+        n++;
+        p++;
+    }
+    return n;
+}
+
+void
+stdin_release_before(char const * p)
+{
+    static size_t released = 0;
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (input == NULL || p < input || page_size <= 0)
+        return;
+
+    /* only whole pages, the rest of the page of 'p' is still to be read */
+    size_t end = (size_t)(p - input);
+    end -= end % page_size;
+    if (end <= released)
+        return;
+
+    madvise((char *)input + released, end - released, MADV_DONTNEED);
+    released = end;
+}
+
+/* Where the line after the last one returned by the reader starts */
+static char const *
+next_line_start(struct line_reader * r)
+{
+    if (r->use_prev_line)
+        return r->l.data ? r->l.data : r->pos;
+
+    if (r->batch_idx < r->batch.size)
+        return r->batch.base + r->batch.start[r->batch_idx];
+
+    return r->pos;
+}
+
+void
+line_reader_skip_to_diff_header(struct line_reader * r, char const ** data, size_t * size)
+{
+    char const * start = next_line_start(r);
+    char const * from = start;
+    char const * end = NULL;
+    size_t lines = 0;
+
+    for (;;) {
+        if (r->end - from >= (ptrdiff_t)DIFF_HEADER_LEN &&
+            memcmp(from, DIFF_HEADER_PREFIX, DIFF_HEADER_LEN) == 0) {
+            end = from;
+            break;
+        }
+
+        end = scan_count_to_diff_header(from, r->end, &lines);
+        if (end != NULL)
+            break;
+
+        /* the reader only has complete lines, so what is to come starts a line */
+        from = r->end;
+
+        if (r->fill == NULL || !r->fill(r)) {
+            end = r->end;
+            break;
+        }
+    }
+
+    *data = start;
+    *size = end - start;
+    r->row += lines;
+
+    if (r == &reader) {
+        pthread_mutex_lock(&row_mark_lock);
+        row_mark = end;
+        row_mark_lines = r->row;
+        pthread_mutex_unlock(&row_mark_lock);
+    }
+
+    r->pos = end;
+    r->batch.size = 0;
+    r->batch_idx = 0;
+    r->batch_lines = FIRST_BATCH_LINES;
+    r->use_prev_line = false;
+}
+
+unsigned
+line_row(struct line const * l)
+{
+    pthread_mutex_lock(&row_mark_lock);
+    char const * mark = row_mark != NULL ? row_mark : input;
+    size_t row = row_mark_lines;
+    pthread_mutex_unlock(&row_mark_lock);
+
+    /* a line that is still to be shown or printed is not released, nor is what follows it */
+    char const * p = l->data != NULL ? l->data : input + input_size;
+    if (p >= mark)
+        row += count_lines(mark, p);
+    else
+        row -= count_lines(p, mark);
+
+    return row + 1;
+}
+
+void
+line_reader_init(struct line_reader * r, char const * data, size_t size)
+{
+    r->pos = data;
+    r->end = data + size;
+    r->batch.size = 0;
+    r->batch_idx = 0;
+    r->batch_lines = FIRST_BATCH_LINES;
+    r->use_prev_line = false;
+    r->row = 0;
+    r->l = (struct line) { .data = NULL, .len = 0, .kind = LINE_KIND_OTHER };
+    r->fill = NULL;
+}
+
+struct line *
+line_reader_next(struct line_reader * r)
+{
+    if (r->use_prev_line) {
+        r->use_prev_line = false;
+        if (r->l.data != NULL)
+            r->row++;
+        return &r->l;
+    }
+
+    struct line * l = &r->l;
+    *l = (struct line) { .data = NULL, .len = 0, .kind = LINE_KIND_OTHER };
+
+    if (r->batch_idx == r->batch.size) {
+        /* only split complete lines, unless there is nothing more to come */
+        while (r->pos >= r->end) {
+            if (r->fill == NULL || !r->fill(r))
+                return l;
+        }
+
+        r->pos = scan_lines(r->pos, r->end, r->batch_lines, &r->batch);
+        r->batch_idx = 0;
+        if (r->batch_lines < LINE_BATCH_SIZE)
+            r->batch_lines *= 2;
+    }
+
+    l->data = r->batch.base + r->batch.start[r->batch_idx];
+    l->len = r->batch.len[r->batch_idx];
+    l->kind = r->batch.kind[r->batch_idx];
+    r->batch_idx++;
+    r->row++;
+
+    return l;
 }
 
 void
-stdin_reset_cur_line(void)
+line_reader_reset_cur_line(struct line_reader * r)
 {
-    use_prev_line = true;
+    if (r->l.data != NULL)
+        r->row--;
+    r->use_prev_line = true;
 }
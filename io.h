@@ -1,18 +1,88 @@
 #ifndef _NADIFF_IO_H_
 #define _NADIFF_IO_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+#include "scan.h"
+
+/*
+ * A view into the input buffer, data is not '\0' terminated and len excludes the '\n'.
+ * At the end of input data is NULL.
+ */
 struct line {
-  char * data;
+  char const * data;
   unsigned len;
-  unsigned row;
+  enum line_kind kind;
 };
 
-/* Don't free the returned line pointer, also don't use it when stdin_read_line is called again. */
+/* Reads lines out of a range of the input buffer */
+struct line_reader {
+    char const * pos; /* where the next batch starts */
+    char const * end; /* end of the complete lines we may split */
+
+    /* Called to move 'end' forward when the reader has run out of lines. Returns false if
+     * there will be no more lines. NULL for a fixed range. */
+    bool (*fill)(struct line_reader * r);
+
+    struct line_batch batch;
+    unsigned batch_idx;
+    unsigned batch_lines; /* lines to split off next, grows while lines are read one by one */
+    size_t row; /* lines before the next line to read */
+
+    struct line l;
+    bool use_prev_line;
+};
+
+/*
+ * Make stdin available in one buffer. A regular file is mapped directly, anything else
+ * (such as a pipe) is spooled into an anonymous mapping as its reader needs more lines.
+ * Must be called before stdin_reader.
+ */
+bool
+stdin_map(void);
+
+/*
+ * The reader for stdin. It blocks until a complete line is available.
+ * Lines are valid for the rest of the program.
+ */
+struct line_reader *
+stdin_reader(void);
+
+/* Block until all of stdin is in memory */
+void
+stdin_read_all(void);
+
+/* If all of stdin is in memory, such as a mapped regular file, return it */
+bool
+stdin_get_all(char const ** data, size_t * size);
+
+/*
+ * Let the system have the memory of stdin before 'p' back, for a reader that won't look at
+ * it again. A pipe reads as zeros there afterwards, so it must not be needed by anyone.
+ */
+void
+stdin_release_before(char const * p);
+
+/* The line number of a line in stdin, only meant for error messages since it is slow */
+unsigned
+line_row(struct line const * l);
+
+void
+line_reader_init(struct line_reader * r, char const * data, size_t size);
+
+/* Don't free the returned line pointer, also don't use it when line_reader_next is called again. */
 struct line *
-stdin_read_line(void);
+line_reader_next(struct line_reader * r);
+
+/* Reset to that we read the previous line again when calling line_reader_next */
+void
+line_reader_reset_cur_line(struct line_reader * r);
 
-/* Reset to that we read the previous line again when calling stdin_read_line */
+/*
+ * Skip all lines up to the next diff header, or the end of the reader. The skipped lines are
+ * returned as a range of the input buffer, the next line read is the diff header.
+ */
 void
-stdin_reset_cur_line(void);
+line_reader_skip_to_diff_header(struct line_reader * r, char const ** data, size_t * size);
 
 #endif
@@ -0,0 +1,295 @@
+#include "line_diff.h"
+
+#include "compare.h"
+#include "scan.h"
+
+#include <ctype.h>
+#include <string.h>
+
+/* lines with more tokens or edits than this are shown without highlights */
+#define MAX_TOKENS 4096
+#define MAX_EDITS 256
+
+/*
+ * The work arrays, kept so diffing a line doesn't allocate once they are big enough. The
+ * tokens of a side are two entries each, where the token starts and ends in the line.
+ */
+static struct uint_array tokens[2];
+static struct uint_array changed[2];
+
+/* the furthest x on each diagonal, and a copy of them after every edit to trace back */
+static struct uint_array furthest;
+static struct uint_array trace;
+
+enum char_class {
+    CLASS_SPACE,
+    CLASS_WORD,
+    CLASS_OTHER,
+};
+
+static enum char_class
+char_class(char c)
+{
+    if (c == ' ' || c == '\t')
+        return CLASS_SPACE;
+
+    /* multibyte characters are taken to be letters */
+    if (isalnum((unsigned char)c) || c == '_' || (unsigned char)c >= 0x80)
+        return CLASS_WORD;
+
+    return CLASS_OTHER;
+}
+
+/*
+ * Does 'c' belong to the same token as 'prev' before it? Words are runs of letters, digits
+ * and '_', spaces are runs of blanks and anything else is a token of its own. Characters
+ * are whole UTF-8 sequences.
+ */
+static bool
+continues_token(char prev, char c, enum line_diff_mode mode)
+{
+    if (mode == LINE_DIFF_CHARS)
+        return ((unsigned char)c & 0xc0) == 0x80;
+
+    enum char_class k = char_class(prev);
+    return k != CLASS_OTHER && k == char_class(c);
+}
+
+static bool
+is_token_start(char const * s, unsigned len, unsigned i, enum line_diff_mode mode)
+{
+    return i == 0 || i >= len || !continues_token(s[i - 1], s[i], mode);
+}
+
+/* Split [start, end) of 's' into tokens. Returns false if there are too many of them. */
+static bool
+split_tokens(char const * s, unsigned start, unsigned end, enum line_diff_mode mode,
+    struct uint_array * t, bool * ok)
+{
+    t->size = 0;
+    *ok = true;
+
+    for (unsigned i = start; i < end;) {
+        if (t->size / 2 == MAX_TOKENS)
+            return false;
+
+        unsigned j = i + 1;
+        while (j < end && continues_token(s[j - 1], s[j], mode))
+            ++j;
+
+        if (!uint_array_reserve(t, 2)) {
+            *ok = false;
+            return false;
+        }
+
+        t->data[t->size++] = i;
+        t->data[t->size++] = j;
+        i = j;
+    }
+
+    return true;
+}
+
+static inline bool
+tokens_equal(char const * a, char const * b, unsigned x, unsigned y)
+{
+    unsigned const * ta = &tokens[0].data[x * 2];
+    unsigned const * tb = &tokens[1].data[y * 2];
+    unsigned len = ta[1] - ta[0];
+
+    return len == tb[1] - tb[0] && memcmp(a + ta[0], b + tb[0], len) == 0;
+}
+
+/*
+ * The fewest edits that turn the tokens of 'a' into those of 'b' (Myers' O(ND) algorithm),
+ * with the furthest reach on every diagonal saved after each edit. Returns the number of
+ * edits, MAX_EDITS + 1 if there are more, or -1 if out of memory.
+ */
+static int
+shortest_edit(char const * a, char const * b, int n, int m)
+{
+    int max = MIN(n + m, MAX_EDITS);
+
+    if (!uint_array_reserve(&furthest, 2 * MAX_EDITS + 3))
+        return -1;
+
+    /* diagonal k is at v[k], with k from -max - 1 to max + 1 */
+    unsigned * v = furthest.data + MAX_EDITS + 1;
+    v[1] = 0;
+    trace.size = 0;
+
+    for (int d = 0; d <= max; ++d) {
+        for (int k = -d; k <= d; k += 2) {
+            int x;
+            if (k == -d || (k != d && v[k - 1] < v[k + 1]))
+                x = v[k + 1]; /* down, a token of 'b' is added */
+            else
+                x = v[k - 1] + 1; /* right, a token of 'a' is removed */
+
+            int y = x - k;
+            while (x < n && y < m && tokens_equal(a, b, x, y))
+                ++x, ++y;
+
+            v[k] = x;
+
+            if (x >= n && y >= m)
+                return d;
+        }
+
+        if (!uint_array_reserve(&trace, 2 * d + 1))
+            return -1;
+
+        memcpy(trace.data + trace.size, v - d, (2 * d + 1) * sizeof(unsigned));
+        trace.size += 2 * d + 1;
+    }
+
+    return MAX_EDITS + 1;
+}
+
+/* Follow the saved diagonals back from the end and mark the tokens that were edited */
+static void
+mark_changed(int n, int m, int edits)
+{
+    int x = n;
+    int y = m;
+
+    for (int d = edits; d > 0; --d) {
+        /* the diagonals after d - 1 edits, which start at d - 1 squared */
+        unsigned const * v = trace.data + (d - 1) * (d - 1) + (d - 1);
+        int k = x - y;
+
+        int prev_k;
+        if (k == -d || (k != d && v[k - 1] < v[k + 1]))
+            prev_k = k + 1;
+        else
+            prev_k = k - 1;
+
+        int prev_x = v[prev_k];
+        int prev_y = prev_x - prev_k;
+
+        if (prev_k == k + 1)
+            changed[1].data[prev_y] = true;
+        else
+            changed[0].data[prev_x] = true;
+
+        x = prev_x;
+        y = prev_y;
+    }
+}
+
+/* Append the runs of changed tokens of a side as ranges, counted in '*count' */
+static bool
+add_ranges(struct uint_array const * t, struct uint_array const * c, struct uint_array * ranges,
+    unsigned * count)
+{
+    unsigned num_tokens = t->size / 2;
+    *count = 0;
+
+    for (unsigned i = 0; i < num_tokens; ++i) {
+        if (!c->data[i])
+            continue;
+
+        unsigned start = t->data[i * 2];
+        while (i + 1 < num_tokens && c->data[i + 1])
+            ++i;
+
+        if (!uint_array_reserve(ranges, 2))
+            return false;
+
+        ranges->data[ranges->size++] = start;
+        ranges->data[ranges->size++] = t->data[i * 2 + 1];
+        (*count)++;
+    }
+
+    return true;
+}
+
+/*
+ * Is anything but blanks left unchanged in 'a'? If not, the line was rewritten and is better
+ * shown as a whole.
+ */
+static bool
+has_common_text(char const * a, unsigned a_len, unsigned prefix, unsigned suffix)
+{
+    for (unsigned i = 0; i < prefix; ++i)
+        if (char_class(a[i]) != CLASS_SPACE)
+            return true;
+
+    for (unsigned i = a_len - suffix; i < a_len; ++i)
+        if (char_class(a[i]) != CLASS_SPACE)
+            return true;
+
+    for (unsigned i = 0; i < changed[0].size; ++i)
+        if (!changed[0].data[i] && char_class(a[tokens[0].data[i * 2]]) != CLASS_SPACE)
+            return true;
+
+    return false;
+}
+
+bool
+line_diff(char const * a, unsigned a_len, char const * b, unsigned b_len,
+    enum line_diff_mode mode, struct uint_array * ranges, unsigned * count_a,
+    unsigned * count_b)
+{
+    *count_a = 0;
+    *count_b = 0;
+
+    if (mode == LINE_DIFF_NONE || a_len == 0 || b_len == 0)
+        return true;
+
+    /* only what is between the common start and end has to be diffed, token by token */
+    unsigned prefix = scan_common_prefix(a, b, MIN(a_len, b_len));
+    if (prefix == a_len && prefix == b_len)
+        return true;
+
+    while (prefix > 0 && !(is_token_start(a, a_len, prefix, mode)
+                && is_token_start(b, b_len, prefix, mode)))
+        --prefix;
+
+    unsigned suffix = scan_common_suffix(a + a_len, b + b_len, MIN(a_len, b_len) - prefix);
+    while (suffix > 0 && !(is_token_start(a, a_len, a_len - suffix, mode)
+                && is_token_start(b, b_len, b_len - suffix, mode)))
+        --suffix;
+
+    bool ok;
+    if (!split_tokens(a, prefix, a_len - suffix, mode, &tokens[0], &ok))
+        return ok;
+    if (!split_tokens(b, prefix, b_len - suffix, mode, &tokens[1], &ok))
+        return ok;
+
+    int n = tokens[0].size / 2;
+    int m = tokens[1].size / 2;
+
+    int edits = shortest_edit(a, b, n, m);
+    if (edits < 0)
+        return false;
+
+    if (edits > MAX_EDITS)
+        return true;
+
+    for (unsigned i = 0; i < 2; ++i) {
+        unsigned num_tokens = tokens[i].size / 2;
+        changed[i].size = 0;
+        if (!uint_array_reserve(&changed[i], num_tokens))
+            return false;
+
+        memset(changed[i].data, 0, num_tokens * sizeof(unsigned));
+        changed[i].size = num_tokens;
+    }
+
+    mark_changed(n, m, edits);
+
+    if (!has_common_text(a, a_len, prefix, suffix))
+        return true;
+
+    unsigned first = ranges->size;
+    if (!add_ranges(&tokens[0], &changed[0], ranges, count_a)
+            || !add_ranges(&tokens[1], &changed[1], ranges, count_b)) {
+        ranges->size = first;
+        *count_a = 0;
+        *count_b = 0;
+        return false;
+    }
+
+    return true;
+}
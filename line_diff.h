@@ -0,0 +1,28 @@
+#ifndef _NADIFF_LINE_DIFF_H_
+#define _NADIFF_LINE_DIFF_H_
+
+#include <stdbool.h>
+#include "types.h"
+
+/* What the changes within a line are made of */
+enum line_diff_mode {
+    LINE_DIFF_NONE,
+    LINE_DIFF_WORDS,
+    LINE_DIFF_CHARS,
+};
+
+/*
+ * Find what changed between line 'a' and line 'b', as the fewest tokens to remove from 'a'
+ * and add from 'b'. The changed bytes are appended to 'ranges' as pairs of where a range
+ * starts and ends in its line, first the '*count_a' ranges of 'a', then the '*count_b'
+ * ranges of 'b'. Lines with nothing in common, or too many changes to be worth showing,
+ * get no ranges. Returns false if out of memory.
+ *
+ * NOTE: Not thread safe, the work arrays are kept between calls
+ */
+bool
+line_diff(char const * a, unsigned a_len, char const * b, unsigned b_len,
+    enum line_diff_mode mode, struct uint_array * ranges, unsigned * count_a,
+    unsigned * count_b);
+
+#endif
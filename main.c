@@ -2,16 +2,21 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h> // isatty()
 
 #include "types.h"
 #include "parse.h"
 #include "render.h"
+#include "stat.h"
 #include "error.h"
 
 const char * semantic_version = "1.1.0";
 
+/* how much input the parser may read ahead of the diffs that --print is done with */
+#define PRINT_READ_AHEAD ((size_t)16 << 20)
+
 static void print_help()
 {
     printf("Usage:\n");
@@ -21,21 +26,57 @@ static void print_help()
     printf("    You get the point.\n");
     printf("    You can also use 'git-nadiff' which is installed together wih nadiff:\n");
     printf("    git-nadiff HEAD~1..HEAD\n");
+    printf("    git diff | nadiff --print --width 200 > diff.txt\n");
+    printf("    git diff | nadiff --json > stats.json\n");
     printf("\n");
-    printf("NOTE: Tabs are displayed as tilde with 3 spaces; '~   '.\n");
+    printf("NOTE: Tabs are displayed as a tilde and spaces up to the next tab stop; '~   '.\n");
     printf("\n");
     printf("Navigation:\n");
     printf("    n           Next diff.\n");
     printf("    N           Previous diff.\n");
+    printf("    ]           Next change.\n");
+    printf("    [           Previous change.\n");
     printf("    k/d         Scroll up in both views.\n");
     printf("    j/c         Scroll down in both views.\n");
     printf("    h/w         Scroll left in both views.\n");
     printf("    l/e         Scroll right in both views.\n");
+    printf("    /           Search all diffs for text, Enter starts the search.\n");
+    printf("    ?           Search all diffs for a POSIX extended regular expression.\n");
+    printf("    n/N         Next and previous search hit while searching.\n");
+    printf("    Esc         End the search.\n");
     printf("    q           Quit.\n");
     printf("\n");
     printf("Options:\n");
+    printf("    --cache     Keep the parsed diff in ~/.cache/nadiff, so the same diff opens\n");
+    printf("                instantly the next time. A cached diff takes about 12 bytes per\n");
+    printf("                line of the diff, the least recently used ones are removed when\n");
+    printf("                they take more than 1 GB. Quitting waits until the cache is\n");
+    printf("                written, but a diff that is not read to the end is not cached.\n");
+    printf("    --color     Print with colors, for --print.\n");
+    printf("    --continuous\n");
+    printf("                Show all diffs one after the other, scrolling runs from the end\n");
+    printf("                of one diff into the next.\n");
+    printf("    --frame-stats\n");
+    printf("                Print the bytes and writes it took to draw each frame on exit.\n");
     printf("    --help      Display this information.\n");
+    printf("    --json      Like --stat, but a JSON object per diff with the path, the old\n");
+    printf("                path of a rename or copy, the status and the counts.\n");
+    printf("    --highlight words|chars|none\n");
+    printf("                Highlight the words or characters that changed within a changed\n");
+    printf("                line, the default is words.\n");
+    printf("    --max-memory N[K|M|G]\n");
+    printf("                Keep the parsed and laid out diffs within N bytes. The diffs that\n");
+    printf("                were looked at longest ago are dropped and made again when shown.\n");
+    printf("    --print     Print all diffs side by side to stdout instead of showing them.\n");
+    printf("                This is the default when stdout is not a terminal.\n");
+    printf("    --stat      Print a line per diff instead of showing them, as soon as it is\n");
+    printf("                read: added lines, removed lines, hunks, status (M, A, D, R or C),\n");
+    printf("                the old path of a rename or copy and the path, separated by tabs.\n");
+    printf("    --tab-width N\n");
+    printf("                Put tab stops N columns apart, the default is 4.\n");
     printf("    --version   Display version information.\n");
+    printf("    --width N   The columns to print the diffs in, for --print. The default is\n");
+    printf("                160.\n");
 }
 
 static void print_version()
@@ -43,21 +84,158 @@ static void print_version()
     printf("nadiff %s\n", semantic_version);
 }
 
+/* A number of bytes, with an optional K, M or G after it */
+static bool
+parse_size(const char * s, size_t * size)
+{
+    char * end = NULL;
+    unsigned long long n = strtoull(s, &end, 10);
+    unsigned shift = 0;
+
+    if (end == s || n == 0)
+        return false;
+
+    if (strcmp(end, "K") == 0)
+        shift = 10;
+    else if (strcmp(end, "M") == 0)
+        shift = 20;
+    else if (strcmp(end, "G") == 0)
+        shift = 30;
+    else if (*end != '\0')
+        return false;
+
+    if (n > (SIZE_MAX >> shift))
+        return false;
+
+    *size = (size_t)n << shift;
+    return true;
+}
+
+static FILE * stderr_capture = NULL;
+static int stderr_fd = -1;
+
+/*
+ * The parser keeps running while we draw on the terminal and anything it writes to stderr
+ * would end up on top of the diffs. Collect it in a temporary file until we are done.
+ */
+static void
+capture_stderr(void)
+{
+    stderr_capture = tmpfile();
+    if (stderr_capture == NULL)
+        return;
+
+    fflush(stderr);
+    stderr_fd = dup(STDERR_FILENO);
+    if (stderr_fd < 0 || dup2(fileno(stderr_capture), STDERR_FILENO) < 0) {
+        fclose(stderr_capture);
+        stderr_capture = NULL;
+    }
+}
+
+static void
+release_stderr(void)
+{
+    if (stderr_capture == NULL)
+        return;
+
+    fflush(stderr);
+    dup2(stderr_fd, STDERR_FILENO);
+    close(stderr_fd);
+
+    char buf[4096];
+    size_t n;
+    rewind(stderr_capture);
+    while ((n = fread(buf, 1, sizeof(buf), stderr_capture)) > 0)
+        fwrite(buf, 1, n, stderr);
+
+    fclose(stderr_capture);
+    stderr_capture = NULL;
+}
+
 int
 main(int argc, char * argv[])
 {
-    if (argc >= 2) {
-        const char * option = argv[1];
+    bool use_cache = false;
+    bool print = !isatty(fileno(stdout));
+    bool stat = false;
+    enum stat_format stat_format = STAT_TEXT;
+    struct render_options ro = {
+        .show_frame_stats = false,
+        .tab_width = 4,
+        .highlight = LINE_DIFF_WORDS,
+        .continuous = false,
+        .max_memory = 0,
+        .width = 160,
+        .colors = false,
+    };
+
+    for (int i = 1; i < argc; ++i) {
+        const char * option = argv[i];
         if (strcmp(option, "--version") == 0 || strcmp(option, "-v") == 0) {
             print_version();
+            return EXIT_SUCCESS;
         } else if (strcmp(option, "--help") == 0 || strcmp(option, "-h") == 0) {
             print_help();
+            return EXIT_SUCCESS;
+        } else if (strcmp(option, "--cache") == 0) {
+            use_cache = true;
+        } else if (strcmp(option, "--stat") == 0) {
+            stat = true;
+            stat_format = STAT_TEXT;
+        } else if (strcmp(option, "--json") == 0) {
+            stat = true;
+            stat_format = STAT_JSON;
+        } else if (strcmp(option, "--print") == 0) {
+            print = true;
+        } else if (strcmp(option, "--color") == 0) {
+            ro.colors = true;
+        } else if (strcmp(option, "--width") == 0) {
+            char * end = NULL;
+            unsigned long n = i + 1 < argc ? strtoul(argv[++i], &end, 10) : 0;
+            if (end == NULL || *end != '\0' || n < 40 || n > 10000) {
+                printf("The width must be a number from 40 to 10000\n");
+                print_help();
+                return EXIT_SUCCESS;
+            }
+            ro.width = n;
+        } else if (strcmp(option, "--continuous") == 0) {
+            ro.continuous = true;
+        } else if (strcmp(option, "--frame-stats") == 0) {
+            ro.show_frame_stats = true;
+        } else if (strcmp(option, "--tab-width") == 0) {
+            char * end = NULL;
+            unsigned long n = i + 1 < argc ? strtoul(argv[++i], &end, 10) : 0;
+            if (end == NULL || *end != '\0' || n == 0 || n > 64) {
+                printf("The tab width must be a number from 1 to 64\n");
+                print_help();
+                return EXIT_SUCCESS;
+            }
+            ro.tab_width = n;
+        } else if (strcmp(option, "--max-memory") == 0) {
+            if (i + 1 == argc || !parse_size(argv[++i], &ro.max_memory)) {
+                printf("The memory budget must be a number of bytes, optionally with K, M or G\n");
+                print_help();
+                return EXIT_SUCCESS;
+            }
+        } else if (strcmp(option, "--highlight") == 0) {
+            const char * mode = i + 1 < argc ? argv[++i] : "";
+            if (strcmp(mode, "words") == 0) {
+                ro.highlight = LINE_DIFF_WORDS;
+            } else if (strcmp(mode, "chars") == 0) {
+                ro.highlight = LINE_DIFF_CHARS;
+            } else if (strcmp(mode, "none") == 0) {
+                ro.highlight = LINE_DIFF_NONE;
+            } else {
+                printf("Unknown highlight mode: '%s'\n", mode);
+                print_help();
+                return EXIT_SUCCESS;
+            }
         } else { /* Unknown option */
             printf("Unknown command line option: '%s'\n", option);
             print_help();
+            return EXIT_SUCCESS;
         }
-
-        return EXIT_SUCCESS;
     }
 
     if (isatty(fileno(stdin))) {
@@ -65,11 +243,29 @@ main(int argc, char * argv[])
         return EXIT_SUCCESS;
     }
 
-    struct diff_array da = {0};
+    /* the diffs are summed up as they are read, without a parser thread */
+    if (stat)
+        return stat_print(stat_format) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    struct diff_stream ds;
+
+    if (!parse_stdin_start(&ds, use_cache, print ? PRINT_READ_AHEAD : 0))
+        return EXIT_FAILURE;
 
-    if (!parse_stdin(&da))
+    /* the list of diffs keeps growing while we display the first ones */
+    if (!parse_stdin_wait_for_first(&ds))
         return EXIT_FAILURE;
 
+    if (print) {
+        bool ok = render_print(&ds, &ro);
+        parse_stdin_finish(&ds);
+
+        if (!ok || parse_stdin_has_failed(&ds))
+            return EXIT_FAILURE;
+
+        return EXIT_SUCCESS;
+    }
+
     FILE * tty = fopen("/dev/tty", "r");
     if (!tty) {
         fprintf(stderr, "Unable to open /dev/tty. Needed when re-setting stdin\n");
@@ -83,11 +279,17 @@ main(int argc, char * argv[])
         return EXIT_FAILURE;
     }
 
-    if (!render(fd, &da)) {
-        fclose(tty);
-        return EXIT_FAILURE;
-    }
+    capture_stderr();
+
+    bool ok = render(fd, &ds, &ro);
 
+    release_stderr();
     fclose(tty);
+
+    parse_stdin_finish(&ds);
+
+    if (!ok || parse_stdin_has_failed(&ds))
+        return EXIT_FAILURE;
+
     return EXIT_SUCCESS;
 }
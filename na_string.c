@@ -30,7 +30,7 @@ get_number(const struct line * l, unsigned * cur_pos, unsigned * out_num)
     while (true) {
         int digit = get_char(l, pos);
         if (digit < 0) {
-            fprintf(stderr, "Failed to parse number at line %u\n", l->row);
+            fprintf(stderr, "Failed to parse number at line %u\n", line_row(l));
             return false;
         }
 
@@ -50,16 +50,30 @@ get_number(const struct line * l, unsigned * cur_pos, unsigned * out_num)
     return true;
 }
 
-bool
-line_starts_with_string(const struct line * l, const char * s)
+unsigned
+utf8_len(char const * s, char const * end)
 {
-    if (l->data == NULL)
-        return false;
-
-    unsigned slen = strlen(s);
-    for (unsigned i = 0; i < slen; ++i)
-        try_ret(is_char_at_idx(l, i, s[i]));
+    unsigned char const * p = (unsigned char const *)s;
+
+    unsigned n;
+    if (p[0] < 0x80)
+        return 1;
+    else if (p[0] >= 0xc2 && p[0] <= 0xdf)
+        n = 2;
+    else if (p[0] >= 0xe0 && p[0] <= 0xef)
+        n = 3;
+    else if (p[0] >= 0xf0 && p[0] <= 0xf4)
+        n = 4;
+    else
+        return 0;
+
+    if (end - s < n)
+        return 0;
+
+    for (unsigned i = 1; i < n; ++i) {
+        if ((p[i] & 0xc0) != 0x80)
+            return 0;
+    }
 
-    return true;
+    return n;
 }
-
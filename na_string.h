@@ -18,7 +18,15 @@ is_char_at_idx(const struct line * l, unsigned idx, char expected);
 bool
 get_number(const struct line * l, unsigned * cur_pos, unsigned * out_num);
 
-bool
-line_starts_with_string(const struct line * l, const char * s);
+/* Length of the UTF-8 sequence at 's', or 0 if it is not a valid one */
+unsigned
+utf8_len(char const * s, char const * end);
+
+/* Characters that move the cursor instead of taking up a column, except for tabs */
+static inline bool
+is_control_char(char c)
+{
+    return (unsigned char)c < 0x20 || c == 0x7f;
+}
 
 #endif
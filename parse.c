@@ -1,114 +1,122 @@
 #include "parse.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include "alloc.h"
+#include "arena.h"
+#include "cache.h"
+#include "compare.h"
+#include "hash.h"
 #include "io.h"
 #include "error.h"
 #include "na_string.h"
 
+/* Inputs smaller than this are parsed by a single thread */
+#define MIN_PARSE_CHUNK_SIZE (4 * 1024 * 1024)
+
 static bool
 is_hunk_header(const struct line * l)
 {
     /* Format is @@ -<NUM>,<NUM> +<NUM>,<NUM> @@ */
-    return is_char_at_idx(l, 0, '@') && is_char_at_idx(l, 1, '@');
+    return l->kind == LINE_KIND_HUNK_HEADER;
 }
 
 static bool
 is_diff_header(const struct line * l)
 {
     /* Format is diff --git <filename> <filename> */
-    return line_starts_with_string(l, "diff --git ");
+    return l->kind == LINE_KIND_DIFF_HEADER;
 }
 
 static bool
 is_old_mode(const struct line * l)
 {
-    return line_starts_with_string(l, "old mode");
+    return l->kind == LINE_KIND_OLD_MODE;
 }
 
 static bool
 is_new_mode(const struct line * l)
 {
     /* TODO also look at the mode */
-    return line_starts_with_string(l, "new mode");
+    return l->kind == LINE_KIND_NEW_MODE;
 }
 
 static bool
 is_copy_from(const struct line * l)
 {
-    return line_starts_with_string(l, "copy from");
+    return l->kind == LINE_KIND_COPY_FROM;
 }
 
 static bool
 is_copy_to(const struct line * l)
 {
-    return line_starts_with_string(l, "copy to");
+    return l->kind == LINE_KIND_COPY_TO;
 }
 
 static bool
 is_index_line(const struct line * l)
 {
-    return line_starts_with_string(l, "index");
+    return l->kind == LINE_KIND_INDEX;
 }
 
 static bool
 is_post_image_add(const struct line * l)
 {
-    return is_char_at_idx(l, 0, '+');
+    return l->kind == LINE_KIND_POST;
 }
 
-static int
+static bool
 is_pre_image_add(const struct line * l)
 {
-    return is_char_at_idx(l, 0, '-');
+    return l->kind == LINE_KIND_PRE;
 }
 
 static bool
 is_extended_header_new_line(const struct line * l)
 {
-    return line_starts_with_string(l, "new file");
+    return l->kind == LINE_KIND_NEW_FILE;
 }
 
 static bool
 is_delete_line(const struct line * l)
 {
-    return line_starts_with_string(l, "delete");
+    return l->kind == LINE_KIND_DELETED;
 }
 
 static bool
 is_similarity_index_line(const struct line * l)
 {
-    return line_starts_with_string(l, "similarity index");
+    return l->kind == LINE_KIND_SIMILARITY;
 }
 
 static bool
 is_rename_from_line(const struct line * l)
 {
-    return line_starts_with_string(l, "rename from");
+    return l->kind == LINE_KIND_RENAME_FROM;
 }
 
 static bool
 is_rename_to_line(const struct line * l)
 {
-    return line_starts_with_string(l, "rename to");
+    return l->kind == LINE_KIND_RENAME_TO;
 }
 
 static bool
 is_dissimiliarity_index_line(const struct line * l)
 {
-    return line_starts_with_string(l, "dissimilarity index");
+    return l->kind == LINE_KIND_DISSIMILARITY;
 }
 
 static bool
 is_binary_file(const struct line * l)
 {
-    /* TODO Verify that this is the only format of Binary file output. Also add filename checks */
-    return line_starts_with_string(l, "Binary files ");
+    return l->kind == LINE_KIND_BINARY;
 }
 
 /*
@@ -126,44 +134,50 @@ is_binary_file(const struct line * l)
  * index <hash>..<hash> <mode>
  */
 static bool
-read_extended_header_lines(struct diff * d)
+read_extended_header_lines(struct line_reader * r, struct diff * d)
 {
     d->status = DIFF_STATUS_CHANGED;
     for (;;) {
-        struct line * l = stdin_read_line();
+        struct line * l = line_reader_next(r);
         if (is_old_mode(l)) {
             /* if old mode, we also expect new mode */
-            l = stdin_read_line();
+            l = line_reader_next(r);
             if (!is_new_mode(l)) {
-                fprintf(stderr, "Expected new mode header line at line %u\n", l->row);
+                fprintf(stderr, "Expected new mode header line at line %u\n", line_row(l));
                 return false;
             }
         } else if (is_copy_from(l)) {
             /* if copy from then we expect copy to */
-            l = stdin_read_line();
+            l = line_reader_next(r);
             if (!is_copy_to(l)) {
-                fprintf(stderr, "Expected copy to header line at line %u\n", l->row);
+                fprintf(stderr, "Expected copy to header line at line %u\n", line_row(l));
                 return false;
             }
+            d->status = DIFF_STATUS_COPIED;
         } else if (is_extended_header_new_line(l)) {
             d->status = DIFF_STATUS_NEW;
         } else if (is_delete_line(l)) {
             d->status = DIFF_STATUS_DELETED;
         } else if (is_similarity_index_line(l) || is_dissimiliarity_index_line(l)) {
-            /* expect rename from, and rename to */
-            l = stdin_read_line();
+            /* expect rename from and rename to, or a copy which is handled above */
+            l = line_reader_next(r);
+            if (is_copy_from(l)) {
+                line_reader_reset_cur_line(r);
+                continue;
+            }
             if (!is_rename_from_line(l)) {
-                fprintf(stderr, "Expected rename from line at line %u\n", l->row);
+                fprintf(stderr, "Expected rename from line at line %u\n", line_row(l));
                 return false;
             }
-            l = stdin_read_line();
+            l = line_reader_next(r);
             if (!is_rename_to_line(l)) {
-                fprintf(stderr, "Expected rename to line at line %u\n", l->row);
+                fprintf(stderr, "Expected rename to line at line %u\n", line_row(l));
                 return false;
             }
+            d->status = DIFF_STATUS_RENAMED;
         } else if (is_index_line(l)) {
             /* expect this extended header to be last */
-            l = stdin_read_line();
+            l = line_reader_next(r);
 
             /* if binary file then we don't to anything else */
             if (!is_binary_file(l)) {
@@ -172,12 +186,12 @@ read_extended_header_lines(struct diff * d)
                 if (!is_diff_header(l) && l->data != NULL)
                     d->expect_line_changes = true;
 
-                stdin_reset_cur_line();
+                line_reader_reset_cur_line(r);
             }
             return true;
         } else {
             /* found a line which is not an extended header line */
-            stdin_reset_cur_line();
+            line_reader_reset_cur_line(r);
             return true;
         }
     }
@@ -206,21 +220,12 @@ is_post_img_line(struct line *l)
 
 /*
  * NOTE: This function will exit program if allocation fails.
- * 'len' should include space for '\0' in the end.
+ * 'len' is the number of characters to copy, a '\0' is added after them.
  */
 static char *
-allocate_string(const struct line * l, unsigned offset, unsigned len)
+allocate_string(struct arena * a, const struct line * l, unsigned offset, unsigned len)
 {
-    char * name = malloc(sizeof(char) * len);
-    if (name == NULL) {
-        fprintf(stderr, "malloc failed when using line at line %u.\n", l->row);
-        exit(EXIT_FAILURE);
-    }
-
-    memcpy(name, l->data + offset, len);
-    /* most strings we copy end with '\0' but some don't, always add '\0' as the final character */
-    name[len - 1] = '\0';
-    return name;
+    return arena_strndup(a, l->data + offset, len);
 }
 
 /*
@@ -271,14 +276,17 @@ set_hunk_header(struct hunk * h, const struct line * l)
         .pre_num_lines = a_num_lines,
         .post_line_nr = b_line_nr,
         .post_num_lines = b_num_lines,
-        .hla = {0},
         .section_name = NULL,
+        .section_name_len = 0,
+        .first_line = 0,
+        .num_lines = 0,
     };
 
-    /* get optional section name */
-    if (i + 1 < l->len) {
+    /* get optional section name, it points into the input buffer */
+    if (i < l->len) {
         try_ret(l->data[i++] == ' ');
-        h->section_name = allocate_string(l, i, l->len - i);
+        h->section_name = l->data + i;
+        h->section_name_len = l->len - i;
     }
 
     return true;
@@ -299,39 +307,30 @@ find_short_name(char * name, unsigned len)
 }
 
 static bool
-set_diff_header(struct diff * d, struct line * l)
+set_diff_header(struct arena * a, struct diff * d, struct line * l)
 {
     /* we only accept git diff -p, where -p is default */
-    const char * diff_header_start = "diff --git ";
-    unsigned i = 0;
-    for (; i < strlen(diff_header_start); ++i)
-        try_ret(is_char_at_idx(l, i, diff_header_start[i]));
+    try_ret(is_diff_header(l));
 
     /* find pre image name and post image name */
-    unsigned start_pos = i;
-    unsigned cur_pos = start_pos;
-
-    /* iterate until we find space */
-    while (true) {
-        int ch = get_char(l, cur_pos);
-        if (ch < 0)
-            return false;
+    static const char diff_header_start[] = "diff --git ";
+    unsigned start_pos = sizeof(diff_header_start) - 1;
 
-        if (ch == ' ')
-            break;
+    /* find the space between the names */
+    char const * space = memchr(l->data + start_pos, ' ', l->len - start_pos);
+    if (space == NULL)
+        return false;
 
-        cur_pos++;
-    }
+    unsigned cur_pos = space - l->data;
 
-    /* Add one for missing '\0' */
-    unsigned pre_img_size = cur_pos - start_pos + 1;
-    char * pre_img_name = allocate_string(l, start_pos, pre_img_size);
+    unsigned pre_img_size = cur_pos - start_pos;
+    char * pre_img_name = allocate_string(a, l, start_pos, pre_img_size);
 
     /* move to character after space */
     cur_pos++;
 
     unsigned post_img_size = l->len - cur_pos;
-    char * post_img_name = allocate_string(l, cur_pos, post_img_size);
+    char * post_img_name = allocate_string(a, l, cur_pos, post_img_size);
 
     *d = (struct diff) {
         .ha = {0},
@@ -344,14 +343,6 @@ set_diff_header(struct diff * d, struct line * l)
     return true;
 }
 
-static char *
-extract_and_allocate_code_line(struct line * l)
-{
-    /* discard first char: '+', '-' or ' ' from size and start */
-    unsigned len = l->len - 1;
-    return allocate_string(l, 1, len);
-}
-
 static enum hunk_line_type get_hunk_line_type(struct line * l)
 {
     if (is_pre_image_add(l))
@@ -362,112 +353,464 @@ static enum hunk_line_type get_hunk_line_type(struct line * l)
         return NEUTRAL_LINE;
 }
 
-static void
-read_hunk_line(struct line * l, struct hunk * h)
+static bool
+read_hunk_line(struct line * l, struct diff * d, struct hunk * h)
 {
     enum hunk_line_type lt = get_hunk_line_type(l);
 
-    struct hunk_line * hl = alloc_hunk_line(&h->hla);
-
-    char * code = NULL;
+    /* The code is kept as an offset into the hunk data, discarding the first char: '+', '-' or ' ' */
+    uint32_t offset = 0;
     unsigned len = 0;
     if (l->len > 1) {
-        /* if not empty line. 1 char is for initial hunk line type '+', '-' or ' '*/
-        code = extract_and_allocate_code_line(l);
-        len = strlen(code);
+        offset = l->data + 1 - d->hunk_data;
+        len = l->len - 1;
+    }
+
+    /* NOTE: longer lines are cut */
+    if (len > HUNK_LINE_MAX_LEN)
+        len = HUNK_LINE_MAX_LEN;
+
+    if (!hunk_line_array_push(&d->hla, offset, hunk_line_pack(len, lt))) {
+        fprintf(stderr, "Failed to allocate hunk line\n");
+        return false;
     }
 
-    *hl = (struct hunk_line) { .line = code, .len = len, .type = lt };
+    h->num_lines++;
+    return true;
 }
 
-bool
-parse_stdin(struct diff_array * da)
+/* Wake up the readers of the stream. NOTE: Must be called with the stream lock held */
+static void
+notify_readers(struct diff_stream * s)
 {
-    enum { STATE_EXPECT_DIFF, STATE_EXPECT_HUNK, STATE_ACCEPT_ALL } state = STATE_EXPECT_DIFF;
+    pthread_cond_broadcast(&s->cond);
 
-    struct diff * d = NULL;
-    struct hunk * h = NULL;
-    struct line * l = NULL;
+    if (s->notify_fd >= 0 && !s->notify_pending) {
+        /* a full pipe already has the news in it */
+        ssize_t ret = write(s->notify_fd, "", 1);
+        s->notify_pending = ret == 1 || (ret < 0 && errno == EAGAIN);
+    }
+}
+
+void
+parse_stdin_notify(struct diff_stream * s)
+{
+    notify_readers(s);
+}
+
+/* Hand over a completely parsed diff to the readers of the stream */
+static bool
+publish_diff(void * ctx, struct diff const * d)
+{
+    struct diff_stream * s = ctx;
+
+    pthread_mutex_lock(&s->lock);
+
+    /* don't read further ahead of a reader that gives back the diffs it is done with */
+    while (s->read_ahead != 0 && s->num_released < s->da.size
+            && s->pending_input > s->read_ahead)
+        pthread_cond_wait(&s->cond, &s->lock);
+
+    struct diff * n = diff_array_push(&s->da);
+    if (n != NULL) {
+        *n = *d;
+        s->pending_input += d->hunk_size;
+        notify_readers(s);
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    if (n == NULL) {
+        fprintf(stderr, "Failed to allocate diff\n");
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+append_diff(void * ctx, struct diff const * d)
+{
+    struct diff * n = diff_array_push(ctx);
+    if (n == NULL) {
+        fprintf(stderr, "Failed to allocate diff\n");
+        return false;
+    }
+
+    *n = *d;
+    return true;
+}
+
+/*
+ * Only the diff headers and extended headers are parsed here. The hunks are skipped and
+ * their range in the input is recorded, they are parsed by parse_diff_hunks when needed.
+ */
+static bool
+parse_diffs(struct line_reader * r, struct arena * text, diff_sink sink, void * ctx)
+{
+    struct diff d;
 
     for (;;) {
-        l = stdin_read_line();
+        struct line * l = line_reader_next(r);
 
-        switch (state) {
-        case STATE_EXPECT_DIFF:
-            if (!is_diff_header(l)) {
-                fprintf(stderr, "Expected diff header at line %u\n", l->row);
+        if (!is_diff_header(l)) {
+            fprintf(stderr, "Expected diff header at line %u\n", line_row(l));
+            return false;
+        }
+
+        if (!set_diff_header(text, &d, l)) {
+            fprintf(stderr, "Could not set diff header at line %u\n", line_row(l));
+            return false;
+        }
+
+        try_ret(read_extended_header_lines(r, &d));
+
+        if (d.expect_line_changes) {
+            l = line_reader_next(r);
+            if (!is_pre_img_line(l)) {
+                fprintf(stderr, "Could not parse pre image line at line %u \n", line_row(l));
                 return false;
             }
 
-            d = alloc_diff(da);
-            if (!set_diff_header(d, l)) {
-                fprintf(stderr, "Could not set diff header at line %u\n", l->row);
+            l = line_reader_next(r);
+            if (!is_post_img_line(l)) {
+                fprintf(stderr, "Could not parse post image line at line %u \n", line_row(l));
                 return false;
             }
 
-            try_ret(read_extended_header_lines(d));
+            line_reader_skip_to_diff_header(r, &d.hunk_data, &d.hunk_size);
+        } else {
+            /* nothing more to parse */
+            d.is_parsed = true;
+        }
+
+        try_ret(sink(ctx, &d));
+
+        l = line_reader_next(r);
+        if (l->data == NULL)
+            return true;
+
+        line_reader_reset_cur_line(r);
+    }
+
+    return true;
+}
+
+/* A part of the input, starting at a diff header, which is parsed by a thread of its own */
+struct parse_chunk {
+    pthread_t thread;
+    char const * data;
+    size_t size;
+
+    struct diff_array da;
+    bool is_ok;
+};
+
+static void *
+parse_chunk_thread(void * arg)
+{
+    struct parse_chunk * c = arg;
+
+    struct line_reader r;
+    line_reader_init(&r, c->data, c->size);
+    c->is_ok = parse_diffs(&r, &c->da.text, append_diff, &c->da);
+
+    return NULL;
+}
+
+static unsigned
+num_parse_chunks(size_t size)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1)
+        cores = 1;
+
+    /* not worth starting threads for small inputs */
+    size_t chunks = size / MIN_PARSE_CHUNK_SIZE;
+    if (chunks < 1)
+        chunks = 1;
+
+    return chunks < (size_t)cores ? chunks : (size_t)cores;
+}
+
+/*
+ * Split the input at diff headers and parse the parts on a thread each. The diffs are
+ * published in input order as the threads finish.
+ */
+static bool
+parse_chunks(struct diff_stream * s, char const * data, size_t size, unsigned num_chunks)
+{
+    struct parse_chunk * chunks = calloc(num_chunks, sizeof(*chunks));
+    if (chunks == NULL) {
+        fprintf(stderr, "Failed to allocate parse chunks\n");
+        return false;
+    }
+
+    char const * end = data + size;
+    char const * start = data;
+    unsigned started = 0;
+    for (unsigned i = 0; i < num_chunks && start < end; ++i) {
+        /* end the chunk at the first diff header after its share of the input */
+        char const * next = end;
+        if (i + 1 < num_chunks) {
+            char const * from = data + size / num_chunks * (i + 1);
+            next = scan_find_diff_header(from > start ? from : start, end);
+            if (next == NULL)
+                next = end;
+        }
+
+        struct parse_chunk * c = &chunks[started];
+        c->data = start;
+        c->size = next - start;
 
-            if (!d->expect_line_changes) {
-                l = stdin_read_line();
+        if (pthread_create(&c->thread, NULL, parse_chunk_thread, c) != 0) {
+            fprintf(stderr, "Failed to start parser thread\n");
+            break;
+        }
 
-                if (l->data == NULL)
-                    return true;
+        started++;
+        start = next;
+    }
 
-                stdin_reset_cur_line();
-                /* Goto next diff */
+    bool ok = start == end;
+    for (unsigned i = 0; i < started; ++i) {
+        struct parse_chunk * c = &chunks[i];
+        pthread_join(c->thread, NULL);
+
+        /* the diffs before the first error are still shown */
+        if (ok) {
+            pthread_mutex_lock(&s->lock);
+            if (diff_array_reserve(&s->da, c->da.size)) {
+                memcpy(&s->da.data[s->da.size], c->da.data, c->da.size * sizeof(struct diff));
+                s->da.size += c->da.size;
             } else {
-                l = stdin_read_line();
-                if (!is_pre_img_line(l)) {
-                    fprintf(stderr, "Could not parse pre image line at line %u \n", l->row);
-                    return false;
-                }
-
-                l = stdin_read_line();
-                if (!is_post_img_line(l)) {
-                    fprintf(stderr, "Could not parse post image line at line %u \n", l->row);
-                    return false;
-                }
-                state = STATE_EXPECT_HUNK;
+                fprintf(stderr, "Failed to allocate diffs\n");
+                ok = false;
             }
+            notify_readers(s);
+            pthread_mutex_unlock(&s->lock);
 
-            break;
+            ok = ok && c->is_ok;
+        }
+
+        /* the names of the diffs live on in the stream */
+        arena_adopt(&s->da.text, &c->da.text);
+        diff_array_release(&c->da);
+    }
+
+    free(chunks);
+    return ok;
+}
+
+/* Returns false if there is no valid cache of the input, without publishing any diff */
+static bool
+load_cache(struct diff_stream * s, char const * data, size_t size, uint64_t key)
+{
+    pthread_mutex_lock(&s->lock);
+
+    bool ok = cache_load(data, size, key, &s->da);
+    if (ok)
+        notify_readers(s);
+    else
+        s->da.size = 0;
+
+    pthread_mutex_unlock(&s->lock);
+    return ok;
+}
+
+/*
+ * Write the cache once the diffs are shown, it only matters the next time. The reader owns
+ * the hunks of the diffs in the stream, so the cache is written from copies of them.
+ */
+static void
+store_cache(struct diff_stream * s, uint64_t key)
+{
+    char const * data;
+    size_t size;
+    if (!stdin_get_all(&data, &size))
+        return;
+
+    pthread_mutex_lock(&s->lock);
+
+    unsigned num_diffs = s->da.size;
+    struct diff * diffs = malloc(num_diffs * sizeof(*diffs));
+    if (diffs != NULL) {
+        for (unsigned i = 0; i < num_diffs; ++i) {
+            diffs[i] = s->da.data[i];
+            diffs[i].ha = (struct hunk_array) {0};
+            diffs[i].hla = (struct hunk_line_array) {0};
+            diffs[i].is_parsed = !diffs[i].expect_line_changes;
+        }
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    if (diffs == NULL) {
+        fprintf(stderr, "Failed to allocate diffs for the cache\n");
+        return;
+    }
+
+    cache_store(data, size, key, diffs, num_diffs);
+    free(diffs);
+}
 
+/* 'store_cache' is set if the diffs should be written to the cache keyed by 'key' */
+static bool
+parse_stdin(struct diff_stream * s, bool * store_cache, uint64_t * key)
+{
+    try_ret(stdin_map());
+
+    char const * data;
+    size_t size;
+
+    /* the cache is keyed by all of the input, so it has to be read first */
+    if (s->use_cache) {
+        stdin_read_all();
+        stdin_get_all(&data, &size);
+
+        *key = hash64(data, size, 0);
+        if (load_cache(s, data, size, *key))
+            return true;
+
+        *store_cache = true;
+    }
+
+    /* a mapped file can be split up right away, a pipe is parsed as it is read */
+    if (stdin_get_all(&data, &size)) {
+        unsigned num_chunks = num_parse_chunks(size);
+        if (num_chunks > 1)
+            return parse_chunks(s, data, size, num_chunks);
+    }
+
+    return parse_diffs(stdin_reader(), &s->da.text, publish_diff, s);
+}
+
+struct each_ctx {
+    diff_sink sink;
+    void * ctx;
+    struct arena * text;
+};
+
+static bool
+hand_over_diff(void * ctx, struct diff const * d)
+{
+    struct each_ctx * c = ctx;
+    bool ok = c->sink(c->ctx, d);
+
+    /* the names are allocated again for the next diff */
+    arena_release(c->text);
+    if (d->hunk_data != NULL)
+        stdin_release_before(d->hunk_data + d->hunk_size);
+
+    return ok;
+}
+
+bool
+parse_stdin_each(diff_sink sink, void * ctx)
+{
+    try_ret(stdin_map());
+
+    struct arena text = {0};
+    struct each_ctx c = { .sink = sink, .ctx = ctx, .text = &text };
+
+    bool ok = parse_diffs(stdin_reader(), &text, hand_over_diff, &c);
+    arena_release(&text);
+
+    return ok;
+}
+
+/*
+ * The hunk header tells us how many lines there are. Every line is a context line counted
+ * on both sides or a line that is only on one side, and there may be a "\ No newline" line
+ * for each side. That is more than enough, but a broken header can't make us reserve more
+ * lines than there is room for in the rest of the diff.
+ */
+static bool
+reserve_hunk_lines(struct diff * d, struct hunk const * h, struct line const * l)
+{
+    size_t max_lines = (size_t)h->pre_num_lines + h->post_num_lines + 2;
+    size_t rest = d->hunk_data + d->hunk_size - l->data;
+    if (max_lines > rest)
+        max_lines = rest;
+
+    return hunk_line_array_reserve(&d->hla, max_lines);
+}
+
+bool
+parse_diff_hunks(struct diff * d)
+{
+    if (d->is_parsed)
+        return true;
+
+    if (d->cached != NULL)
+        return cache_load_hunks(d);
+
+    /* the lines are kept as 32 bit offsets into the hunk data */
+    if (d->hunk_size > UINT32_MAX) {
+        fprintf(stderr, "The diff of %s is too large\n", d->post_img_name);
+        return false;
+    }
+
+    enum { STATE_EXPECT_HUNK, STATE_ACCEPT_ALL } state = STATE_EXPECT_HUNK;
+
+    struct line_reader r;
+    line_reader_init(&r, d->hunk_data, d->hunk_size);
+
+    struct hunk * h = NULL;
+    struct line * l = NULL;
+
+    for (;;) {
+        l = line_reader_next(&r);
+
+        switch (state) {
         case STATE_EXPECT_HUNK:
             if (!is_hunk_header(l)) {
-                fprintf(stderr, "Expected hunk header at line %u\n", l->row);
+                fprintf(stderr, "Expected hunk header at line %u\n", line_row(l));
                 return false;
             }
 
-            h = alloc_hunk(&d->ha);
+            h = hunk_array_push(&d->ha);
+            if (h == NULL) {
+                fprintf(stderr, "Failed to allocate hunk\n");
+                return false;
+            }
 
             if (!set_hunk_header(h, l)) {
-                fprintf(stderr, "Failed to set hunk header at line %u\n", l->row);
+                fprintf(stderr, "Failed to set hunk header at line %u\n", line_row(l));
+                return false;
+            }
+            h->first_line = d->hla.size;
+
+            if (!reserve_hunk_lines(d, h, l)) {
+                fprintf(stderr, "Failed to allocate hunk lines\n");
                 return false;
             }
 
-            l = stdin_read_line();
+            l = line_reader_next(&r);
             if (l->data == NULL) {
-                fprintf(stderr, "Expected hunk line at line %u\n", l->row);
+                fprintf(stderr, "Expected hunk line at line %u\n", line_row(l));
                 return false;
             }
-            read_hunk_line(l, h);
+            try_ret(read_hunk_line(l, d, h));
 
             state = STATE_ACCEPT_ALL;
 
             break;
 
         case STATE_ACCEPT_ALL:
-            if (l->data == NULL)
+            if (l->data == NULL) {
+                /* the diff keeps its hunks for as long as it is shown */
+                hunk_array_shrink(&d->ha);
+                hunk_line_array_shrink(&d->hla);
+                d->is_parsed = true;
                 return true;
+            }
 
-            if (is_diff_header(l)) {
-                state = STATE_EXPECT_DIFF;
-                stdin_reset_cur_line();
-            } else if (is_hunk_header(l)) {
+            if (is_hunk_header(l)) {
                 state = STATE_EXPECT_HUNK;
-                stdin_reset_cur_line();
+                line_reader_reset_cur_line(&r);
             } else {
-                read_hunk_line(l, h);
+                try_ret(read_hunk_line(l, d, h));
             }
 
             break;
@@ -476,3 +819,174 @@ parse_stdin(struct diff_array * da)
 
     return true;
 }
+
+bool
+count_diff_hunks(struct diff const * d, struct hunk_counts * c)
+{
+    *c = (struct hunk_counts) {0};
+
+    if (d->hunk_data == NULL)
+        return true;
+
+    struct line_reader r;
+    line_reader_init(&r, d->hunk_data, d->hunk_size);
+
+    struct line * l = line_reader_next(&r);
+    if (!is_hunk_header(l)) {
+        fprintf(stderr, "Expected hunk header at line %u\n", line_row(l));
+        return false;
+    }
+
+    while (l->data != NULL) {
+        if (is_hunk_header(l)) {
+            struct hunk h;
+            if (!set_hunk_header(&h, l)) {
+                fprintf(stderr, "Failed to set hunk header at line %u\n", line_row(l));
+                return false;
+            }
+            c->hunks++;
+
+            l = line_reader_next(&r);
+            if (l->data == NULL) {
+                fprintf(stderr, "Expected hunk line at line %u\n", line_row(l));
+                return false;
+            }
+        }
+
+        enum hunk_line_type lt = get_hunk_line_type(l);
+        if (lt == PRE_LINE)
+            c->pre_lines++;
+        else if (lt == POST_LINE)
+            c->post_lines++;
+
+        l = line_reader_next(&r);
+    }
+
+    return true;
+}
+
+static void *
+parse_thread(void * arg)
+{
+    struct diff_stream * s = arg;
+
+    bool store = false;
+    uint64_t key = 0;
+    bool ok = parse_stdin(s, &store, &key);
+
+    pthread_mutex_lock(&s->lock);
+    s->is_done = true;
+    s->is_ok = ok;
+    notify_readers(s);
+    pthread_mutex_unlock(&s->lock);
+
+    if (ok && store)
+        store_cache(s, key);
+
+    return NULL;
+}
+
+bool
+parse_stdin_start(struct diff_stream * s, bool use_cache, size_t read_ahead)
+{
+    *s = (struct diff_stream) {
+        .da = {0},
+        .notify_fd = -1,
+        .is_done = false,
+        .is_ok = false,
+        .use_cache = use_cache,
+        .read_ahead = read_ahead,
+    };
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    if (pthread_create(&s->thread, NULL, parse_thread, s) != 0) {
+        fprintf(stderr, "Failed to start parser thread\n");
+        return false;
+    }
+
+    /* the cache is written after parsing, parse_stdin_finish() waits for it */
+    if (!use_cache)
+        pthread_detach(s->thread);
+
+    return true;
+}
+
+void
+parse_stdin_finish(struct diff_stream * s)
+{
+    if (!s->use_cache)
+        return;
+
+    pthread_mutex_lock(&s->lock);
+    bool done = s->is_done;
+    pthread_mutex_unlock(&s->lock);
+
+    if (done)
+        pthread_join(s->thread, NULL);
+}
+
+bool
+parse_stdin_wait_for_first(struct diff_stream * s)
+{
+    pthread_mutex_lock(&s->lock);
+    while (s->da.size == 0 && !s->is_done)
+        pthread_cond_wait(&s->cond, &s->lock);
+
+    bool has_diffs = s->da.size > 0;
+    pthread_mutex_unlock(&s->lock);
+
+    return has_diffs;
+}
+
+bool
+parse_stdin_has_failed(struct diff_stream * s)
+{
+    pthread_mutex_lock(&s->lock);
+    bool failed = s->is_done && !s->is_ok;
+    pthread_mutex_unlock(&s->lock);
+
+    return failed;
+}
+
+void
+release_diff_hunks(struct diff * d)
+{
+    hunk_array_release(&d->ha);
+
+    /* the lines of a cached diff are part of the mapped cache file */
+    if (d->hla.cap != 0)
+        hunk_line_array_release(&d->hla);
+    else
+        d->hla = (struct hunk_line_array) {0};
+
+    d->is_parsed = false;
+}
+
+void
+parse_stdin_release_input(struct diff_stream * s, unsigned i)
+{
+    pthread_mutex_lock(&s->lock);
+
+    struct diff const * d = &s->da.data[i];
+    char const * end = d->hunk_data != NULL ? d->hunk_data + d->hunk_size : NULL;
+
+    /* the diffs of a mapped file are published without counting their hunks */
+    s->pending_input -= MIN(s->pending_input, d->hunk_size);
+    s->num_released = i + 1;
+    pthread_cond_broadcast(&s->cond);
+
+    pthread_mutex_unlock(&s->lock);
+
+    if (!s->use_cache && end != NULL)
+        stdin_release_before(end);
+}
+
+void
+parse_stdin_set_notify_fd(struct diff_stream * s, int fd)
+{
+    pthread_mutex_lock(&s->lock);
+    s->notify_fd = fd;
+    s->notify_pending = false;
+    pthread_mutex_unlock(&s->lock);
+}
@@ -2,10 +2,114 @@
 #define _NADIFF_PARSE_H_
 
 #include <stdbool.h>
+#include <pthread.h>
 #include "types.h"
 
+/*
+ * Diffs are parsed from stdin in a thread of their own and appended to 'da' while holding
+ * 'lock', so they can be displayed before all of stdin has been read. A diff is never
+ * changed by the parser once it has been appended, only 'da' itself might be reallocated.
+ */
+struct diff_stream {
+    struct diff_array da;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* signalled when a diff is appended or parsing is done */
+    pthread_t thread;
+
+    /*
+     * A byte is also written to 'notify_fd' at those times, unless one was written since
+     * the reader cleared 'notify_pending'. That way a reader can poll() for news.
+     */
+    int notify_fd;
+    bool notify_pending;
+
+    bool is_done;
+    bool is_ok;
+
+    /* read the diffs from the on-disk cache, or write them there once parsed */
+    bool use_cache;
+
+    /*
+     * With a limit, the parser waits while the hunks of the diffs the reader is not done
+     * with take more than 'read_ahead' bytes, see parse_stdin_release_input()
+     */
+    size_t read_ahead;
+    size_t pending_input;
+    unsigned num_released;
+};
+
+/* Called with every diff that is parsed */
+typedef bool (*diff_sink)(void * ctx, struct diff const * d);
+
+/*
+ * Parse stdin on this thread and hand every diff to 'sink' as soon as its hunks are read,
+ * without keeping it. Its hunks are not parsed, and its names and the input up to its end
+ * are given back once 'sink' returns, so memory doesn't grow with the input.
+ */
+bool
+parse_stdin_each(diff_sink sink, void * ctx);
+
+/* 'read_ahead' is 0 for a reader that keeps all diffs */
+bool
+parse_stdin_start(struct diff_stream * s, bool use_cache, size_t read_ahead);
+
+/* Returns false if parsing ended without a single diff */
+bool
+parse_stdin_wait_for_first(struct diff_stream * s);
+
+/*
+ * Call before exiting. With the cache in use and all diffs parsed, this waits until the
+ * cache is written. An input that is not read to the end yet is not cached.
+ */
+void
+parse_stdin_finish(struct diff_stream * s);
+
+bool
+parse_stdin_has_failed(struct diff_stream * s);
+
+/*
+ * Tell the parser that the reader is done with diff 'i' for good, after the diffs before
+ * it, and give back the memory of the input up to its end. Nothing is given back when the
+ * diffs are cached, the cache is written from all of the input.
+ */
+void
+parse_stdin_release_input(struct diff_stream * s, unsigned i);
+
+/* Start writing to 'fd' when the stream changes, or stop if 'fd' is -1 */
+void
+parse_stdin_set_notify_fd(struct diff_stream * s, int fd);
+
+/*
+ * Wake up the readers of the stream, for those that add to what the readers look at.
+ * NOTE: Must be called with the stream lock held
+ */
+void
+parse_stdin_notify(struct diff_stream * s);
+
+/*
+ * Parse the hunks of a diff, unless that is already done. Only the parser may change a
+ * diff before it is appended to the stream, so this must be called by its reader.
+ */
+bool
+parse_diff_hunks(struct diff * d);
+
+/* Free what parse_diff_hunks() allocated, which leaves the diff to be parsed again */
+void
+release_diff_hunks(struct diff * d);
+
+struct hunk_counts {
+    unsigned long long hunks;
+    unsigned long long pre_lines;
+    unsigned long long post_lines;
+};
+
+/*
+ * Read the hunks of a diff with the same checks as parse_diff_hunks(), but only count them
+ * and their lines. Nothing is kept, and the diff is left as it is.
+ */
 bool
-parse_stdin(struct diff_array * da);
+count_diff_hunks(struct diff const * d, struct hunk_counts * c);
 
 
 #endif
@@ -1,8 +1,12 @@
 #include "render.h"
+#include "parse.h"
 #include "error.h"
 #include "vt100.h"
 #include "alloc.h"
 #include "compare.h"
+#include "na_string.h"
+#include "line_diff.h"
+#include "search.h"
 
 #include <assert.h>
 #include <ctype.h>
@@ -11,6 +15,9 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <termios.h>
 #include <unistd.h>
@@ -25,48 +32,152 @@ struct window {
 };
 
 static bool redraw = false;
+
+/* set by the SIGWINCH handler, which also wakes up the render loop through 'wake_fds' */
+static volatile sig_atomic_t window_changed = 0;
+static int wake_fds[2] = { -1, -1 };
+
+/* frames that were not drawn because the terminal had not taken the one before */
+static unsigned dropped_frames = 0;
+
+/*
+ * A thread that lays out the render lines of diffs before they are shown: the ones next to
+ * the shown diff first, then all the others. Everything but the work itself happens with
+ * the stream lock held, which also protects the render line pairs.
+ */
+#define NO_DIFF UINT_MAX
+#define PRECOMPUTE_NEIGHBOURS 2
+
+static pthread_t precompute_thread;
+static bool precompute_started = false;
+static bool precompute_stop = false;
+static unsigned precompute_idx = NO_DIFF; /* the diff being laid out */
+static unsigned precompute_next = 0; /* every diff before this one is laid out */
+static char precompute_error[400]; /* why laying out a diff failed, for the render thread */
+
+/*
+ * With a memory budget, the diffs that were used longest ago give back their render lines
+ * and parsed hunks when the budget is exceeded, and get them again when they are shown.
+ * The diffs that hold any are kept in a list from the most to the least recently used.
+ */
+struct lru_node {
+    unsigned prev, next;
+    bool is_listed;
+    size_t bytes;
+};
+
+struct lru_node_array {
+    ARRAY_FIELDS(struct lru_node);
+};
+
+ARRAY_FUNCTIONS(lru_node_array, struct lru_node)
+
+static size_t max_memory = 0; /* no budget if 0 */
+static size_t used_memory = 0;
+static struct lru_node_array lru;
+static unsigned lru_head = NO_DIFF;
+static unsigned lru_tail = NO_DIFF;
+static unsigned evicted_diffs = 0;
+
+/* the current diff is still being laid out, draw again when it is done */
+static bool placeholder_shown = false;
 static unsigned diff_idx = 0;
 static unsigned diff_start = 0;
+
+/* how far the diffs were scrolled since the last frame, negative when scrolled up */
+static int scrolled_lines = 0;
 static unsigned horizontal_offset = 0;
 
+/*
+ * In continuous mode the diffs are shown one after the other as one long run of rows, each
+ * diff starting with its names. Diff i starts at row 'row_index.data[i]' and the last entry
+ * is where the diffs counted so far end. Diffs are counted when their rows are needed.
+ */
+#define DIFF_HEADER_ROWS 2
+
+static bool continuous = false;
+static struct uint_array row_index;
+static unsigned global_start = 0; /* the row at the top of the diff windows */
+
+/* the widest lines of the diffs shown in continuous mode */
+static unsigned shown_max_len_a0 = 0;
+static unsigned shown_max_len_a1 = 0;
+
+/*
+ * Searching. The pattern is typed in on the bottom row, and once the search runs, n and N
+ * go to the next and previous hit instead of diff until it is ended with Escape.
+ */
+#define SEARCH_PATTERN_MAX 200
+
+static bool search_prompt = false; /* the pattern is being typed in */
+static enum search_kind prompt_kind = SEARCH_LITERAL;
+static char search_pattern[SEARCH_PATTERN_MAX + 1];
+static unsigned search_pattern_len = 0;
+static char search_error[200];
+
+/* what to do with the search once the stream lock is released */
+static bool search_start_requested = false;
+static bool search_stop_requested = false;
+
+static bool search_active = false;
+static unsigned hit_diff = NO_DIFF; /* the shown hit, its index among the hits of its diff */
+static unsigned hit_idx = 0;
+
+/* 1 or -1 while waiting for the diffs up to the next or previous hit to be searched */
+static int search_jump = 0;
+
+/* what the search had found when we last drew */
+static unsigned shown_hits = 0;
+static bool shown_search_done = false;
+
 static unsigned list_visible_start = 0;
 static unsigned list_visible_end = 0;
 
+/* what the parser had delivered when we last drew, so we know when to draw again */
+static unsigned shown_diffs = 0;
+static bool shown_done = false;
+
 static struct window list_window;
 static struct window diff0_window;
 static struct window diff1_window;
 
 #define LINE_NBR_WIDTH 5
+
+/* columns between tab stops */
+static unsigned tab_width = 4;
+
+/* what the changes within changed lines are shown as */
+static enum line_diff_mode highlight_mode = LINE_DIFF_WORDS;
+
 #define MOVE_DIFF_LINES 5
 
+/* the rows shown above a search hit or a change that is jumped to */
+#define CONTEXT_ROWS 3
+
+/* the rows laid out above and below the shown rows of a diff */
+#define WINDOW_MARGIN 1024
+
+/* the rows render_print() draws into a frame before printing them */
+#define PRINT_ROWS 256
+
+/*
+ * Only the render thread writes error_msg. Any other thread that lays out diffs points
+ * error_buf at a buffer of its own.
+ */
 char error_msg[400];
+static _Thread_local char * error_buf = error_msg;
 #define set_error_msg(fmt, ...) \
-    snprintf(error_msg, sizeof(error_msg), "%s:%d " fmt, __FILE__, __LINE__, ##__VA_ARGS__);
+    snprintf(error_buf, sizeof(error_msg), "%s:%d " fmt, __FILE__, __LINE__, ##__VA_ARGS__);
 
 static void print_error_msg(void)
 {
     fprintf(stderr, "%s\n", error_msg);
 }
 
-/* Custom strlen function that takes tabs into consideration */
-static size_t
-strlen_tabs(char const * data, unsigned len)
-{
-    size_t space_len = 0;
-    for (unsigned i = 0; i < len; ++i) {
-        char c = data[i];
-        if (c == '\t')
-            space_len += 4;
-        else
-            space_len++;
-    }
-
-    return space_len;
-}
-
 static void
-draw_list(struct diff_array * da, struct window * list)
+draw_list(struct diff_stream * ds, struct window * list)
 {
+    struct diff_array * da = &ds->da;
     unsigned list_width = list->br.x - list->tl.x;
 
     char line[list_width];
@@ -101,223 +212,476 @@ draw_list(struct diff_array * da, struct window * list)
     }
 
     vt100_set_default_colors();
+
+    /* let the user know that the list is still growing */
+    unsigned status_row = da->size - list_visible_start + 2;
+    if ((!ds->is_done || !ds->is_ok) && status_row + 1 <= list->br.y) {
+        const char * status = ds->is_done ? "parse error" : "loading..";
+        vt100_set_pos(list->tl.x, list->tl.y + status_row);
+        vt100_set_yellow_foreground();
+        vt100_write(status, strlen(status), list_width);
+        vt100_set_default_colors();
+    }
+}
+
+/*
+ * How many columns the character at 'data[i]' takes when it starts at 'col', and in
+ * '*bytes' its length. Tabs go to the next tab stop. Control characters take no column,
+ * they are left out when drawn, and invalid UTF-8 takes a column per byte.
+ */
+static unsigned
+char_columns(char const * data, unsigned len, unsigned i, unsigned col, unsigned * bytes)
+{
+    char c = data[i];
+
+    *bytes = 1;
+    if (c == '\t')
+        return tab_width - col % tab_width;
+    if (is_control_char(c))
+        return 0;
+
+    unsigned n = utf8_len(data + i, data + len);
+    if (n > 1)
+        *bytes = n;
+
+    return 1;
 }
 
+/*
+ * The width of a line in columns. A line that doesn't take a column per byte has
+ * 'columns' set, and if it is long, an entry in the column index.
+ */
 static bool
-convert_tabs(char ** data, unsigned * len)
+measure_line(struct render_line_pair * p, char const * data, unsigned len, uint32_t offset,
+    unsigned * width, bool * columns)
 {
-    if (*len == 0)
-        return true;
+    unsigned col = 0;
+    *columns = false;
+
+    for (unsigned i = 0, bytes; i < len; i += bytes) {
+        unsigned w = char_columns(data, len, i, col, &bytes);
+        if (w != 1 || bytes != 1)
+            *columns = true;
+        col += w;
+    }
 
-    size_t space_len = strlen_tabs(*data, *len);
+    *width = col;
 
-    /* no tabs found? No need to reallocate line */
-    if (space_len == *len)
+    if (!*columns || col <= COLUMN_STEP)
         return true;
 
-    char * new_data = malloc(sizeof(char) * space_len);
+    struct column_index * ci = column_index_array_push(&p->col_index);
+    if (ci == NULL) {
+        set_error_msg("Failed to allocate column index");
+        return false;
+    }
+
+    ci->offset = offset;
+    ci->first = p->col_bytes.size;
 
-    unsigned si = 0;
-    for (unsigned i = 0; i < *len; ++i) {
-        if ((*data)[i] == '\t') {
-            new_data[si++] = '~';
-            new_data[si++] = ' ';
-            new_data[si++] = ' ';
-            new_data[si++] = ' ';
-        } else {
-            new_data[si++] = (*data)[i];
+    col = 0;
+    unsigned next = COLUMN_STEP;
+    for (unsigned i = 0, bytes; i < len; i += bytes) {
+        unsigned w = char_columns(data, len, i, col, &bytes);
+
+        /* a tab might cover more than one step */
+        for (; next < col + w; next += COLUMN_STEP) {
+            if (!uint_array_reserve(&p->col_bytes, 2)) {
+                set_error_msg("Failed to allocate column index");
+                return false;
+            }
+
+            p->col_bytes.data[p->col_bytes.size++] = i;
+            p->col_bytes.data[p->col_bytes.size++] = col;
+            ci->count++;
         }
+
+        col += w;
     }
-    free(*data);
 
-    *data = new_data;
-    *len = space_len;
+    return true;
+}
+
+/* Add a row of a type and its flags, see struct render_row_array */
+static bool
+add_render_row(struct render_line_pair * p, uint32_t flags, uint32_t line0, uint32_t line1)
+{
+    if (!render_row_array_push(&p->rows, line0, line1, flags)) {
+        set_error_msg("Failed to allocate render row");
+        return false;
+    }
 
     return true;
 }
 
-static void
-render_section_name(char * section_name, struct render_line_array * a0,
-    struct render_line_array * a1, bool is_first_section)
+/* The rows of a block */
+static unsigned
+block_rows(struct row_block const * b)
 {
-    if (section_name == NULL)
-        return;
+    if (b->type == ROW_BLOCK_CHANGE)
+        return MAX(b->num_pre, b->num_post);
 
-    unsigned len = strlen(section_name);
+    return b->num_pre;
+}
 
-    convert_tabs(&section_name, &len);
+/* Start a block of hunk 'hunk' at line 'first_line', on the row after the last block */
+static struct row_block *
+add_row_block(struct render_line_pair * p, enum row_block_type type, unsigned hunk,
+    unsigned first_line)
+{
+    unsigned row = 0;
+    if (p->blocks.size > 0) {
+        struct row_block const * last = &p->blocks.data[p->blocks.size - 1];
+        row = last->row + block_rows(last);
+    }
 
-    /* add some padding before the next section */
-    if (!is_first_section) {
-        for (unsigned i = 0; i < 2; ++i) {
-            struct render_line * l0 = alloc_render_line(a0);
-            struct render_line * l1 = alloc_render_line(a1);
-            l0->type = l1->type = RENDER_LINE_SPACE;
-        }
+    struct row_block * b = row_block_array_push(&p->blocks);
+    if (b == NULL) {
+        set_error_msg("Failed to allocate row block");
+        return NULL;
     }
 
-    struct render_line * l0 = alloc_render_line(a0);
-    *l0 = (struct render_line) {
-        .type = RENDER_LINE_SECTION_NAME, .data = section_name, .len = len
-    };
+    b->type = type;
+    b->row = row;
+    b->hunk = hunk;
+    b->first_line = first_line;
 
-    struct render_line * l1 = alloc_render_line(a1);
-    *l1 = (struct render_line) {
-        .type = RENDER_LINE_SECTION_NAME, .data = section_name, .len = len
-    };
+    return b;
 }
 
+/*
+ * Split the rows of a diff into blocks. Only the types of its lines are looked at, the
+ * lines are laid out once their rows are shown.
+ */
 static bool
-populate_render_line_arrays(struct diff * d, struct render_line_pair * p)
+populate_render_line_arrays(struct diff const * d, struct render_line_pair * p)
 {
     if (p->is_populated)
         return true;
 
-    enum { STATE_NORMAL, STATE_PRE, STATE_POST } state = STATE_NORMAL;
-    struct render_line_array * a0 = &p->a0;
-    struct render_line_array * a1 = &p->a1;
     struct hunk_array const * ha = &d->ha;
+    struct hunk_line_array const * hla = &d->hla;
 
     for (unsigned i = 0; i < ha->size; ++i) {
-        struct hunk * h = &ha->data[i];
+        struct hunk const * h = &ha->data[i];
+
+        /* the section name, after some padding unless it is the first */
+        if (h->section_name != NULL) {
+            struct row_block * b = add_row_block(p, ROW_BLOCK_SECTION, i, h->first_line);
+            if (b == NULL)
+                return false;
 
-        bool is_first_section = i == 0;
-        render_section_name(h->section_name, a0, a1, is_first_section);
+            b->num_pre = i == 0 ? 1 : 3;
+        }
 
-        struct hunk_line_array const * hla = &h->hla;
         unsigned pre_line_nr = h->pre_line_nr;
         unsigned post_line_nr = h->post_line_nr;
-        unsigned num_pre_lines = 0;
-        unsigned num_post_lines = 0;
+        struct row_block * b = NULL;
 
-        for (unsigned j = 0; j < hla->size; ++j) {
-            struct hunk_line * hl = &hla->data[j];
+        for (unsigned j = h->first_line; j < h->first_line + h->num_lines; ++j) {
+            enum hunk_line_type type = hunk_line_type(hla, j);
+            enum row_block_type block_type =
+                type == NEUTRAL_LINE ? ROW_BLOCK_NORMAL : ROW_BLOCK_CHANGE;
 
-            convert_tabs(&hl->line, &hl->len);
+            /* a pre line after post lines starts another change */
+            if (b == NULL || b->type != block_type || (type == PRE_LINE && b->num_post > 0)) {
+                b = add_row_block(p, block_type, i, j);
+                if (b == NULL)
+                    return false;
 
-            struct render_line * l0 = NULL;
-            struct render_line * l1 = NULL;
+                b->pre_line_nr = pre_line_nr;
+                b->post_line_nr = post_line_nr;
+            }
 
-            switch (hl->type) {
+            switch (type) {
             case PRE_LINE:
-                l0 = alloc_render_line(a0);
-                *l0 = (struct render_line) {
-                    .type = RENDER_LINE_PRE,
-                    .data = hl->line, .len = hl->len, .line_nr = pre_line_nr++
-                };
+                b->num_pre++;
+                pre_line_nr++;
+                break;
+            case POST_LINE:
+                b->num_post++;
+                post_line_nr++;
+                break;
+            default:
+                b->num_pre++;
+                pre_line_nr++;
+                post_line_nr++;
+            }
+        }
+    }
 
-                state = STATE_PRE;
+    if (p->blocks.size > 0) {
+        struct row_block const * last = &p->blocks.data[p->blocks.size - 1];
+        p->num_rows = last->row + block_rows(last);
+    }
 
-                num_pre_lines++;
+    row_block_array_shrink(&p->blocks);
+    p->is_populated = true;
 
-                break;
-            case POST_LINE:
-                l1 = alloc_render_line(a1);
-                *l1 = (struct render_line) {
-                    .type = RENDER_LINE_POST,
-                    .data = hl->line, .len = hl->len, .line_nr = post_line_nr++
-                };
+    return true;
+}
 
-                state = STATE_POST;
+/*
+ * The number of rows populate_render_line_arrays() finds in a diff with parsed hunks,
+ * without keeping its blocks.
+ */
+static unsigned
+count_render_rows(struct diff const * d)
+{
+    struct hunk_array const * ha = &d->ha;
+    struct hunk_line_array const * hla = &d->hla;
+    unsigned rows = 0;
 
-                num_post_lines++;
+    for (unsigned i = 0; i < ha->size; ++i) {
+        struct hunk const * h = &ha->data[i];
 
-                break;
-            default:
-                if (state == STATE_PRE) {
-                    /* pre -> normal. We should pad with post lines. */
-                    if (num_post_lines) {
-                        /* Sanity check, we should not have any post lines */
-                        set_error_msg("Should not encounter any post lines");
-                        return false;
-                    }
-
-                    for (unsigned i = 0; i < num_pre_lines; ++i) {
-                        l1 = alloc_render_line(a1);
-                        l1->type = RENDER_LINE_POST_LINE;
-                    }
-                } else if (state == STATE_POST) {
-                    /* pre -> post -> normal or post -> normal. Should possibly pad either
-                     * pre or post lines. */
-                    if (num_pre_lines > num_post_lines) {
-                        /* More pre than post lines, pad with post lines */
-                        for (unsigned p = 0; p < (num_pre_lines - num_post_lines); ++p) {
-                            struct render_line *l1 = alloc_render_line(a1);
-                            l1->type = RENDER_LINE_POST_LINE;
-                        }
-                    } else if (num_post_lines > num_pre_lines) {
-                        /* more post than pre lines, pad with pre lines */
-                        for (unsigned p = 0; p < (num_post_lines - num_pre_lines); ++p) {
-                            struct render_line *l0 = alloc_render_line(a0);
-                            l0->type = RENDER_LINE_PRE_LINE;
-                        }
-                    }
-                }
+        if (h->section_name != NULL)
+            rows += i == 0 ? 1 : 3;
+
+        unsigned num_pre_lines = 0;
+        unsigned num_post_lines = 0;
+
+        for (unsigned j = h->first_line; j < h->first_line + h->num_lines; ++j) {
+            enum hunk_line_type type = hunk_line_type(hla, j);
 
+            /* a change takes the rows of its longer side */
+            if (type == NEUTRAL_LINE || (type == PRE_LINE && num_post_lines > 0)) {
+                rows += MAX(num_pre_lines, num_post_lines);
                 num_pre_lines = 0;
                 num_post_lines = 0;
-                state = STATE_NORMAL;
-
-                l0 = alloc_render_line(a0);
-                *l0 = (struct render_line) {
-                    .type = RENDER_LINE_NORMAL,
-                    .data = hl->line, .len = hl->len, .line_nr = pre_line_nr++
-                };
-
-                l1 = alloc_render_line(a1);
-                *l1 = (struct render_line) {
-                    .type = RENDER_LINE_NORMAL,
-                    .data = hl->line, .len = hl->len, .line_nr = post_line_nr++
-                };
             }
 
-            if (l0 && l0->len > p->max_len_a0)
-                p->max_len_a0 = l0->len;
-            if (l1 && l1->len > p->max_len_a1)
-                p->max_len_a1 = l1->len;
-        }
-
-        /* It could be that we are ending with a pre or a post instead of a normal.
-         * Then we need to make sure we are not missing to add any pad lines */
-        if (num_pre_lines || num_post_lines) {
-            if (num_pre_lines > num_post_lines) {
-                /* more pre than post, pad with post lines. */
-                for (unsigned p = 0; p < (num_pre_lines - num_post_lines); ++p) {
-                    struct render_line *l1 = alloc_render_line(a1);
-                    l1->type = RENDER_LINE_POST_LINE;
-                }
-            } else if (num_post_lines > num_pre_lines) {
-                /* more post than pre, pad with pre lines. */
-                for (unsigned p = 0; p < (num_post_lines - num_pre_lines); ++p) {
-                    struct render_line *l0 = alloc_render_line(a0);
-                    l0->type = RENDER_LINE_PRE_LINE;
-                }
+            if (type == PRE_LINE)
+                num_pre_lines++;
+            else if (type == POST_LINE)
+                num_post_lines++;
+            else
+                rows++;
+        }
+
+        rows += MAX(num_pre_lines, num_post_lines);
+    }
+
+    return rows;
+}
+
+/* The block that row 'row' is in, which must be a row of the diff */
+static unsigned
+find_row_block(struct render_line_pair const * p, unsigned row)
+{
+    /* the last block that starts at or before 'row' */
+    unsigned lo = 0;
+    unsigned hi = p->blocks.size;
+    while (hi - lo > 1) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (p->blocks.data[mid].row <= row)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* Measure hunk line 'j', which is on 'side' of laid out row 'i' */
+static bool
+measure_hunk_line(struct diff const * d, struct render_line_pair * p, unsigned j, unsigned i,
+    unsigned side)
+{
+    uint32_t offset = d->hla.offset[j];
+    unsigned width;
+    bool columns;
+
+    try_ret(measure_line(p, d->hunk_data + offset, hunk_line_len(&d->hla, j), offset, &width,
+                &columns));
+
+    if (columns)
+        p->rows.flags[i] |= RENDER_ROW_COLUMNS(side);
+
+    p->max_len[side] = MAX(p->max_len[side], width);
+    return true;
+}
+
+/*
+ * Lay out rows 'k0' to 'k1' of block 'b'. The lines are measured in the order of the hunk
+ * lines, which keeps the column index sorted.
+ */
+static bool
+layout_block(struct diff const * d, struct render_line_pair * p, struct row_block const * b,
+    unsigned k0, unsigned k1)
+{
+    uint32_t const both_sides = RENDER_ROW_COLUMNS(0) | RENDER_ROW_COLUMNS(1);
+    unsigned first = p->rows.size;
+
+    switch (b->type) {
+    case ROW_BLOCK_SECTION:
+        for (unsigned k = k0; k < k1; ++k) {
+            if (k + 1 < block_rows(b)) {
+                try_ret(add_render_row(p, RENDER_ROW_SPACE, NO_RENDER_LINE, NO_RENDER_LINE));
+                continue;
             }
 
+            struct hunk const * h = &d->ha.data[b->hunk];
+            unsigned width;
+            bool columns;
+            try_ret(measure_line(p, h->section_name, h->section_name_len,
+                        h->section_name - d->hunk_data, &width, &columns));
+
+            try_ret(add_render_row(p, RENDER_ROW_SECTION_NAME | (columns ? both_sides : 0),
+                        b->hunk, b->hunk));
+        }
+        break;
+    case ROW_BLOCK_NORMAL:
+        /* the line is on both sides, but measured once */
+        for (unsigned k = k0; k < k1; ++k) {
+            unsigned j = b->first_line + k;
+            uint32_t offset = d->hla.offset[j];
+            unsigned width;
+            bool columns;
+            try_ret(measure_line(p, d->hunk_data + offset, hunk_line_len(&d->hla, j), offset,
+                        &width, &columns));
+
+            try_ret(add_render_row(p, RENDER_ROW_NORMAL | (columns ? both_sides : 0), j, j));
+
+            p->max_len[0] = MAX(p->max_len[0], width);
+            p->max_len[1] = MAX(p->max_len[1], width);
+        }
+        break;
+    case ROW_BLOCK_CHANGE:
+        /* the side with fewer lines is padded, so what follows lines up again */
+        for (unsigned k = k0; k < k1; ++k) {
+            uint32_t pre = k < b->num_pre ? b->first_line + k : NO_RENDER_LINE;
+            uint32_t post = k < b->num_post ? b->first_line + b->num_pre + k : NO_RENDER_LINE;
+            try_ret(add_render_row(p, RENDER_ROW_CHANGE, pre, post));
+        }
+
+        for (unsigned side = 0; side < 2; ++side) {
+            for (unsigned i = first; i < p->rows.size; ++i) {
+                uint32_t j = p->rows.line[side][i];
+                if (j != NO_RENDER_LINE)
+                    try_ret(measure_hunk_line(d, p, j, i, side));
+            }
         }
+        break;
     }
 
-    p->is_populated = true;
+    return true;
+}
+
+/* Lay out rows 'first' to 'end' of a diff in place of the rows laid out before */
+static bool
+layout_rows(struct diff const * d, struct render_line_pair * p, unsigned first, unsigned end)
+{
+    p->first_row = first;
+    p->rows.size = 0;
+    p->col_index.size = 0;
+    p->col_bytes.size = 0;
+    p->highlights.size = 0;
+    p->highlight_bytes.size = 0;
+    p->max_len[0] = 0;
+    p->max_len[1] = 0;
+
+    if (first == end)
+        return true;
+
+    for (unsigned i = find_row_block(p, first); i < p->blocks.size; ++i) {
+        struct row_block const * b = &p->blocks.data[i];
+        if (b->row >= end)
+            break;
+
+        unsigned k0 = first > b->row ? first - b->row : 0;
+        unsigned k1 = MIN(block_rows(b), end - b->row);
+        try_ret(layout_block(d, p, b, k0, k1));
+    }
 
     return true;
 }
 
+/*
+ * Lay out the 'n' rows from 'first' on, unless they are. The rows around them are laid out
+ * too, so that scrolling through a diff doesn't lay out rows every time.
+ */
+static bool
+layout_window(struct diff const * d, struct render_line_pair * p, unsigned first, unsigned n)
+{
+    unsigned end = MIN(first + n, p->num_rows);
+    first = MIN(first, end);
+
+    if (first >= p->first_row && end <= p->first_row + p->rows.size)
+        return true;
+
+    return layout_rows(d, p, first - MIN(first, WINDOW_MARGIN),
+        MIN(end + WINDOW_MARGIN, p->num_rows));
+}
+
+/*
+ * The row of the line at 'offset' of the hunk data, 0 if there is no such line. The lines
+ * of one byte or less are at offset 0, the others are in order.
+ */
+static unsigned
+find_line_row(struct diff const * d, struct render_line_pair const * p, uint32_t offset)
+{
+    struct hunk_line_array const * hla = &d->hla;
+
+    unsigned lo = 0;
+    unsigned hi = hla->size;
+    unsigned j = UINT_MAX;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        unsigned m = mid;
+        while (m < hi && hla->offset[m] == 0)
+            ++m;
+
+        if (m == hi || hla->offset[m] > offset) {
+            hi = mid;
+        } else if (hla->offset[m] < offset) {
+            lo = m + 1;
+        } else {
+            j = m;
+            break;
+        }
+    }
+
+    if (j == UINT_MAX || p->blocks.size == 0)
+        return 0;
+
+    /* the last block of lines that starts at or before line j, after the section name */
+    lo = 0;
+    hi = p->blocks.size;
+    while (hi - lo > 1) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (p->blocks.data[mid].first_line <= j)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    struct row_block const * b = &p->blocks.data[lo];
+    unsigned k = j - b->first_line;
+    if (b->type == ROW_BLOCK_CHANGE && k >= b->num_pre)
+        k -= b->num_pre;
+
+    return b->row + k;
+}
+
+/* The line number of a search hit is shown in reverse */
 static bool
-display_line_number(struct render_line * l, char * line, int window_width)
+display_line_number(enum render_line_type type, unsigned line_nr, char * line, int window_width,
+    bool is_hit)
 {
     const char * LINE_NUMBER = "%4u";
 
-    switch (l->type) {
+    switch (type) {
     case RENDER_LINE_SPACE:
     case RENDER_LINE_SECTION_NAME:
         return true;
     case RENDER_LINE_NORMAL:
         vt100_set_default_colors();
-        snprintf(line, window_width, LINE_NUMBER, l->line_nr);
+        snprintf(line, window_width, LINE_NUMBER, line_nr);
         break;
     case RENDER_LINE_POST_LINE:
     case RENDER_LINE_PRE_LINE:
-        if (l->type == RENDER_LINE_PRE_LINE)
+        if (type == RENDER_LINE_PRE_LINE)
             vt100_set_red_foreground();
         else
             vt100_set_green_foreground();
@@ -325,26 +689,163 @@ display_line_number(struct render_line * l, char * line, int window_width)
         break;
     case RENDER_LINE_PRE:
     case RENDER_LINE_POST:
-        if (l->type == RENDER_LINE_PRE)
+        if (type == RENDER_LINE_PRE)
             vt100_set_red_foreground();
         else
             vt100_set_green_foreground();
-        snprintf(line, window_width, LINE_NUMBER, l->line_nr);
+        snprintf(line, window_width, LINE_NUMBER, line_nr);
         break;
     default:
-        set_error_msg("Should not enter here with type: %u" , l->type);
+        set_error_msg("Should not enter here with type: %u" , type);
         return false;
     }
 
+    if (is_hit)
+        vt100_set_inverted_colors();
+
     vt100_write(line, strlen(line), window_width);
 
+    if (is_hit)
+        vt100_set_default_colors();
+
     return true;
 }
 
+/* The text on 'side' of laid out row 'i', none for pad lines and spaces */
+static char const *
+row_text(struct diff const * d, struct render_line_pair const * p, unsigned i, unsigned side,
+    unsigned * len)
+{
+    uint32_t j = p->rows.line[side][i];
+    *len = 0;
+
+    switch (render_row_type(&p->rows, i)) {
+    case RENDER_ROW_SPACE:
+        return NULL;
+    case RENDER_ROW_SECTION_NAME:
+        *len = d->ha.data[j].section_name_len;
+        return d->ha.data[j].section_name;
+    default:
+        if (j == NO_RENDER_LINE)
+            return NULL;
+
+        *len = hunk_line_len(&d->hla, j);
+        return d->hunk_data + d->hla.offset[j];
+    }
+}
+
+static struct column_index const *
+find_column_index(struct render_line_pair const * p, uint32_t offset)
+{
+    unsigned lo = 0;
+    unsigned hi = p->col_index.size;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (p->col_index.data[mid].offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo < p->col_index.size && p->col_index.data[lo].offset == offset)
+        return &p->col_index.data[lo];
+
+    return NULL;
+}
+
+/* The changed bytes of a line are shown in reverse, in the colour of the line */
+static void
+set_highlight(enum render_line_type type, bool on)
+{
+    vt100_set_default_colors();
+    if (type == RENDER_LINE_PRE)
+        vt100_set_red_foreground();
+    else
+        vt100_set_green_foreground();
+
+    if (on)
+        vt100_set_inverted_colors();
+}
+
+/*
+ * Draw the columns of a line from 'horizontal_offset' on, with the 'num_ranges' changed
+ * ranges of 'ranges' highlighted. Tabs are drawn as a '~' and spaces up to the next tab
+ * stop.
+ */
+static void
+display_line_columns(struct diff const * d, struct render_line_pair const * p, unsigned row,
+    unsigned side, unsigned window_width, unsigned const * ranges, unsigned num_ranges)
+{
+    enum render_line_type type = render_row_line_type(&p->rows, row, side);
+    unsigned len;
+    char const * data = row_text(d, p, row, side, &len);
+    unsigned first = horizontal_offset;
+    unsigned end = first + window_width;
+    unsigned i = 0;
+    unsigned col = 0;
+
+    /* start from the closest column we know the byte of */
+    if (!(p->rows.flags[row] & RENDER_ROW_COLUMNS(side))) {
+        i = col = MIN(first, len);
+    } else if (first >= COLUMN_STEP) {
+        unsigned step = first / COLUMN_STEP;
+        struct column_index const * ci = find_column_index(p, data - d->hunk_data);
+        if (ci != NULL) {
+            if (step > ci->count)
+                return;
+
+            i = p->col_bytes.data[ci->first + (step - 1) * 2];
+            col = p->col_bytes.data[ci->first + (step - 1) * 2 + 1];
+        }
+    }
+
+    /* a column is at most one UTF-8 character */
+    char buf[window_width * 4];
+    unsigned n = 0;
+    unsigned r = 0;
+    bool highlighted = false;
+
+    for (unsigned bytes; i < len && col < end; i += bytes) {
+        unsigned w = char_columns(data, len, i, col, &bytes);
+
+        while (r < num_ranges && i >= ranges[r * 2 + 1])
+            ++r;
+
+        bool in_range = r < num_ranges && i >= ranges[r * 2];
+        if (in_range != highlighted && col + w > first) {
+            vt100_write(buf, n, n);
+            n = 0;
+            set_highlight(type, in_range);
+            highlighted = in_range;
+        }
+
+        if (data[i] == '\t') {
+            for (unsigned c = MAX(col, first); c < col + w && c < end; ++c)
+                buf[n++] = c == col ? '~' : ' ';
+        } else if (w == 1 && col >= first) {
+            memcpy(&buf[n], &data[i], bytes);
+            n += bytes;
+        }
+
+        col += w;
+    }
+
+    vt100_write(buf, n, n);
+
+    /* the line number of the next row is drawn in the colour of its line */
+    if (highlighted)
+        set_highlight(type, false);
+}
+
 static bool
-display_line(struct render_line * l, int window_width)
+display_line(struct diff const * d, struct render_line_pair const * p, unsigned i,
+    unsigned side, unsigned window_width, unsigned const * ranges, unsigned num_ranges)
 {
-    switch (l->type) {
+    enum render_line_type type = render_row_line_type(&p->rows, i, side);
+    unsigned len;
+    char const * data = row_text(d, p, i, side, &len);
+
+    switch (type) {
     case RENDER_LINE_SPACE:
     case RENDER_LINE_PRE_LINE:
     case RENDER_LINE_POST_LINE:
@@ -362,89 +863,125 @@ display_line(struct render_line * l, int window_width)
         vt100_set_red_foreground();
         break;
     default:
-        set_error_msg("Should not enter here with type: %u" , l->type);
+        set_error_msg("Should not enter here with type: %u" , type);
         return false;
     }
 
-    if (horizontal_offset < l->len)
-        vt100_write(l->data + horizontal_offset, l->len - horizontal_offset, window_width);
+    if ((p->rows.flags[i] & RENDER_ROW_COLUMNS(side)) || num_ranges > 0)
+        display_line_columns(d, p, i, side, window_width, ranges, num_ranges);
+    else if (horizontal_offset < len)
+        vt100_write(data + horizontal_offset, len - horizontal_offset, window_width);
 
     return true;
 }
 
+/*
+ * Is laid out row 'i' a pre line next to a post line, which are diffed to highlight what
+ * changed
+ */
 static bool
-draw_windows(struct diff * d, struct window * diff0, struct window * diff1,
-    struct render_line_pair * p)
+is_changed_row(struct render_line_pair const * p, unsigned i)
 {
-    unsigned cur_vt100_diff0_row = diff0->tl.y;
-    unsigned cur_vt100_diff1_row = diff1->tl.y;
-
-    unsigned diff0_width = diff0->br.x - diff0->tl.x;
-    unsigned diff1_width = diff1->br.x - diff1->tl.x;
-    /* draw pre and post names */
-
-    vt100_set_pos(diff0->tl.x, cur_vt100_diff0_row++);
-    vt100_write(d->pre_img_name, strlen(d->pre_img_name), diff0_width);
-
-    /* for now let's assume diff0 and diff1 have same width */
-    char diff_line[diff0_width];
-    for (unsigned i = 0; i < diff0_width; ++i)
-        diff_line[i] = '-';
-
-    vt100_set_pos(diff0->tl.x, cur_vt100_diff0_row++);
-    vt100_write(diff_line, diff0_width, diff0_width);
-
-    vt100_set_pos(diff1->tl.x, cur_vt100_diff1_row++);
-    vt100_write(d->post_img_name, strlen(d->post_img_name), diff1_width);
-
-    vt100_set_pos(diff1->tl.x, cur_vt100_diff1_row++);
-    vt100_write(diff_line, diff0_width, diff0_width);
-
-    /* let's display hunks */
-    struct render_line_array * a0 = &p->a0;
-    struct render_line_array * a1 = &p->a1;
+    return i < p->rows.size && render_row_type(&p->rows, i) == RENDER_ROW_CHANGE
+        && p->rows.line[0][i] != NO_RENDER_LINE && p->rows.line[1][i] != NO_RENDER_LINE;
+}
 
-    for (unsigned i = diff_start; i < a0->size; ++i) {
-        if (cur_vt100_diff0_row == diff0->br.y)
-            break;
+/*
+ * Diff the changed lines of the 'rows' rows from 'start', unless that is already done. The
+ * rows must be laid out.
+ */
+static bool
+highlight_rows(struct diff const * d, struct render_line_pair * p, unsigned start,
+    unsigned rows)
+{
+    if (highlight_mode == LINE_DIFF_NONE || start < p->first_row)
+        return true;
 
-        struct render_line * l = &a0->data[i];
+    struct line_highlight_array * ha = &p->highlights;
+    unsigned end = MIN(start - p->first_row + rows, p->rows.size);
 
-        char line[diff0_width];
+    for (unsigned i = start - p->first_row; i < end; ++i) {
+        if (!is_changed_row(p, i))
+            continue;
 
-        vt100_set_pos(diff0->tl.x, cur_vt100_diff0_row);
+        /* the rows are only given highlights once one of them is shown */
+        if (ha->size < p->rows.size) {
+            if (!line_highlight_array_reserve(ha, p->rows.size - ha->size)) {
+                set_error_msg("Failed to allocate line highlights");
+                return false;
+            }
 
-        try_ret(display_line_number(l, line, diff0_width));
+            while (ha->size < p->rows.size)
+                ha->data[ha->size++] = (struct line_highlight) { .first = HIGHLIGHT_NOT_DONE };
+        }
 
-        vt100_set_pos(diff0->tl.x + LINE_NBR_WIDTH, cur_vt100_diff0_row);
+        struct line_highlight * h = &ha->data[i];
+        if (h->first != HIGHLIGHT_NOT_DONE)
+            continue;
+
+        unsigned len0, len1, count0, count1;
+        char const * line0 = row_text(d, p, i, 0, &len0);
+        char const * line1 = row_text(d, p, i, 1, &len1);
+        unsigned first = p->highlight_bytes.size;
+        if (!line_diff(line0, len0, line1, len1, highlight_mode, &p->highlight_bytes, &count0,
+                    &count1)) {
+            set_error_msg("Failed to allocate line highlights");
+            return false;
+        }
 
-        try_ret(display_line(l, diff0_width - LINE_NBR_WIDTH));
+        *h = (struct line_highlight) { .first = first, .count0 = count0, .count1 = count1 };
+    }
 
-        cur_vt100_diff0_row++;
+    return true;
+}
 
-    }
+/*
+ * Draw 'side' of the rows from row 'first' of the diff on, at the rows from 'row' to 'end'
+ * of the screen. The rows must be laid out. The line at 'hit_offset' of the hunk data is a
+ * search hit, none if it is 0.
+ */
+static bool
+draw_render_lines(struct diff const * d, struct render_line_pair const * p, unsigned side,
+    struct window * w, unsigned row, unsigned first, unsigned end, uint32_t hit_offset)
+{
+    unsigned width = w->br.x - w->tl.x;
+    char line[width];
 
-    vt100_set_default_colors();
+    if (first < p->first_row)
+        return true;
 
-    for (unsigned i = diff_start; i < a1->size; ++i) {
+    /* the line numbers are counted from the start of the block of the row */
+    unsigned b = find_row_block(p, first);
 
-        if (cur_vt100_diff1_row == diff1->br.y)
-            break;
+    for (unsigned i = first - p->first_row; i < p->rows.size && row != end; ++i, ++row) {
+        enum render_line_type type = render_row_line_type(&p->rows, i, side);
+        uint32_t j = p->rows.line[side][i];
 
-        struct render_line * l = &a1->data[i];
+        unsigned r = p->first_row + i;
+        while (b + 1 < p->blocks.size && p->blocks.data[b + 1].row <= r)
+            ++b;
 
-        char line[diff1_width];
-        line[diff1_width - 1] = '\n';
+        struct row_block const * rb = &p->blocks.data[b];
+        unsigned line_nr = (side == 0 ? rb->pre_line_nr : rb->post_line_nr) + r - rb->row;
 
-        vt100_set_pos(diff1->tl.x, cur_vt100_diff1_row);
+        vt100_set_pos(w->tl.x, row);
 
-        try_ret(display_line_number(l, line, diff1_width));
+        bool is_hit = hit_offset != 0 && j != NO_RENDER_LINE
+            && render_row_type(&p->rows, i) != RENDER_ROW_SECTION_NAME
+            && d->hla.offset[j] == hit_offset;
+        try_ret(display_line_number(type, line_nr, line, width, is_hit));
 
-        vt100_set_pos(diff1->tl.x + LINE_NBR_WIDTH, cur_vt100_diff1_row);
+        vt100_set_pos(w->tl.x + LINE_NBR_WIDTH, row);
 
-        try_ret(display_line(l, diff1_width - LINE_NBR_WIDTH));
+        unsigned const * ranges = NULL;
+        unsigned num_ranges = 0;
+        if (i < p->highlights.size && p->highlights.data[i].first != HIGHLIGHT_NOT_DONE) {
+            struct line_highlight const * h = &p->highlights.data[i];
+            ranges = &p->highlight_bytes.data[h->first + (side == 1 ? h->count0 * 2 : 0)];
+            num_ranges = side == 1 ? h->count1 : h->count0;
+        }
 
-        cur_vt100_diff1_row++;
+        try_ret(display_line(d, p, i, side, width - LINE_NBR_WIDTH, ranges, num_ranges));
     }
 
     vt100_set_default_colors();
@@ -452,24 +989,89 @@ draw_windows(struct diff * d, struct window * diff0, struct window * diff1,
     return true;
 }
 
+/* Draw row 'r' of the names above the render lines of a diff, at 'row' of the windows */
 static void
-calculate_dimensions(struct vt100_dims * d, struct window * list, struct window * diff0, struct window * diff1)
+draw_diff_header_row(struct diff const * d, struct window * diff0, struct window * diff1,
+    unsigned r, unsigned row)
 {
-    /* Layout:
-     * +-+-----+-----+
-     * | |     |     |
-     * |A|  B  |  C  |
-     * | |     |     |
-     * +-+-----+-----+
-     *
-     * where A is diff list, and B and C are diff0 (pre) and diff1 (post) windows.
-     */
+    unsigned diff0_width = diff0->br.x - diff0->tl.x;
+    unsigned diff1_width = diff1->br.x - diff1->tl.x;
 
-    /* calculate sizes of list and code windows */
-    unsigned window_max = 200;
-    unsigned list_max = 40;
-    unsigned screen_width = d->cols - 1;
-    unsigned screen_height = d->rows - 1;
+    if (r == 0) {
+        /* draw pre and post names */
+        vt100_set_pos(diff0->tl.x, row);
+        vt100_write(d->pre_img_name, strlen(d->pre_img_name), diff0_width);
+
+        vt100_set_pos(diff1->tl.x, row);
+        vt100_write(d->post_img_name, strlen(d->post_img_name), diff1_width);
+        return;
+    }
+
+    /* for now let's assume diff0 and diff1 have same width */
+    char diff_line[diff0_width];
+    for (unsigned i = 0; i < diff0_width; ++i)
+        diff_line[i] = '-';
+
+    vt100_set_pos(diff0->tl.x, row);
+    vt100_write(diff_line, diff0_width, diff0_width);
+
+    vt100_set_pos(diff1->tl.x, row);
+    vt100_write(diff_line, diff0_width, diff0_width);
+}
+
+/* Draw the names of the diff and its render lines, or a placeholder if 'p' is NULL */
+static bool
+draw_windows(struct diff * d, struct window * diff0, struct window * diff1,
+    struct render_line_pair * p, uint32_t hit_offset)
+{
+    unsigned cur_vt100_diff0_row = diff0->tl.y;
+    unsigned cur_vt100_diff1_row = diff1->tl.y;
+
+    unsigned diff0_width = diff0->br.x - diff0->tl.x;
+
+    for (unsigned r = 0; r < DIFF_HEADER_ROWS; ++r)
+        draw_diff_header_row(d, diff0, diff1, r, diff0->tl.y + r);
+
+    cur_vt100_diff0_row += DIFF_HEADER_ROWS;
+    cur_vt100_diff1_row += DIFF_HEADER_ROWS;
+
+    /* the hunks are not laid out yet */
+    if (p == NULL) {
+        static char const * const status = "preparing..";
+        vt100_set_pos(diff0->tl.x + LINE_NBR_WIDTH, cur_vt100_diff0_row);
+        vt100_set_yellow_foreground();
+        vt100_write(status, strlen(status), diff0_width);
+        vt100_set_default_colors();
+        return true;
+    }
+
+    /* let's display hunks */
+    try_ret(draw_render_lines(d, p, 0, diff0, cur_vt100_diff0_row, diff_start, diff0->br.y,
+                hit_offset));
+    try_ret(draw_render_lines(d, p, 1, diff1, cur_vt100_diff1_row, diff_start, diff1->br.y,
+                hit_offset));
+
+    return true;
+}
+
+static void
+calculate_dimensions(struct vt100_dims * d, struct window * list, struct window * diff0, struct window * diff1)
+{
+    /* Layout:
+     * +-+-----+-----+
+     * | |     |     |
+     * |A|  B  |  C  |
+     * | |     |     |
+     * +-+-----+-----+
+     *
+     * where A is diff list, and B and C are diff0 (pre) and diff1 (post) windows.
+     */
+
+    /* calculate sizes of list and code windows */
+    unsigned window_max = 200;
+    unsigned list_max = 40;
+    unsigned screen_width = d->cols - 1;
+    unsigned screen_height = d->rows - 1;
 
     unsigned list_width = MIN(screen_width * 0.1, list_max);
 
@@ -491,140 +1093,1048 @@ calculate_dimensions(struct vt100_dims * d, struct window * list, struct window
         .br = { .x = list->br.x + window_width + 1, .y = screen_height  + 1}
     };
 
-    *diff1 = (struct window) {
-        .tl = { .x = diff0->br.x + 1, .y = 1 },
-        .br = { .x = diff0->br.x + window_width + 1, .y = screen_height + 1}
-    };
+    *diff1 = (struct window) {
+        .tl = { .x = diff0->br.x + 1, .y = 1 },
+        .br = { .x = diff0->br.x + window_width + 1, .y = screen_height + 1}
+    };
+}
+
+static
+bool is_terminal_too_small(struct vt100_dims * d)
+{
+    /* we need at least 10 width list, 20 width diff A and 20 width diff B */
+    return d->cols < 101 || d->rows < 21;
+}
+
+static void
+release_render_line_pair(struct render_line_pair * p)
+{
+    render_row_array_release(&p->rows);
+    column_index_array_release(&p->col_index);
+    uint_array_release(&p->col_bytes);
+    row_block_array_release(&p->blocks);
+    line_highlight_array_release(&p->highlights);
+    uint_array_release(&p->highlight_bytes);
+    *p = (struct render_line_pair) {0};
+}
+
+/* What the parsed hunks and the render lines of a diff take */
+static size_t
+diff_memory(struct diff const * d, struct render_line_pair const * p)
+{
+    /* the lines of a cached diff are part of the mapped cache file */
+    size_t bytes = (size_t)d->ha.cap * sizeof(struct hunk)
+        + (size_t)d->hla.cap * 2 * sizeof(uint32_t);
+
+    bytes += (size_t)p->rows.cap * 3 * sizeof(uint32_t);
+    bytes += (size_t)p->col_index.cap * sizeof(struct column_index);
+    bytes += (size_t)p->blocks.cap * sizeof(struct row_block);
+    bytes += (size_t)(p->col_bytes.cap + p->highlight_bytes.cap) * sizeof(unsigned);
+    bytes += (size_t)p->highlights.cap * sizeof(struct line_highlight);
+
+    return bytes;
+}
+
+static void
+lru_unlink(unsigned i)
+{
+    struct lru_node * n = &lru.data[i];
+    if (!n->is_listed)
+        return;
+
+    if (n->prev != NO_DIFF)
+        lru.data[n->prev].next = n->next;
+    else
+        lru_head = n->next;
+
+    if (n->next != NO_DIFF)
+        lru.data[n->next].prev = n->prev;
+    else
+        lru_tail = n->prev;
+
+    n->is_listed = false;
+}
+
+static void
+lru_push_front(unsigned i)
+{
+    struct lru_node * n = &lru.data[i];
+    n->prev = NO_DIFF;
+    n->next = lru_head;
+    n->is_listed = true;
+
+    if (lru_head != NO_DIFF)
+        lru.data[lru_head].prev = i;
+    else
+        lru_tail = i;
+
+    lru_head = i;
+}
+
+/*
+ * Count what diff 'i' takes now and make it the most recently used.
+ * NOTE: Must be called with the stream lock held
+ */
+static void
+account_diff(struct diff_array const * da, struct render_line_pair_array const * pa, unsigned i)
+{
+    if (max_memory == 0)
+        return;
+
+    struct lru_node * n = &lru.data[i];
+    used_memory -= n->bytes;
+    n->bytes = diff_memory(&da->data[i], &pa->data[i]);
+    used_memory += n->bytes;
+
+    lru_unlink(i);
+    if (n->bytes > 0)
+        lru_push_front(i);
+}
+
+/*
+ * Once over the budget, release the least recently used diffs until there is a quarter of
+ * it to spare, so this doesn't happen again on the next diff. The shown diff and the one
+ * the precompute thread works on are kept.
+ * NOTE: Must be called with the stream lock held
+ */
+static void
+evict_diffs(struct diff_array * da, struct render_line_pair_array * pa)
+{
+    if (max_memory == 0 || used_memory <= max_memory)
+        return;
+
+    unsigned i = lru_tail;
+    while (i != NO_DIFF && used_memory > max_memory / 4 * 3) {
+        unsigned prev = lru.data[i].prev;
+
+        if (i != diff_idx && i != precompute_idx) {
+            release_render_line_pair(&pa->data[i]);
+            release_diff_hunks(&da->data[i]);
+
+            used_memory -= lru.data[i].bytes;
+            lru.data[i].bytes = 0;
+            lru_unlink(i);
+            evicted_diffs++;
+        }
+
+        i = prev;
+    }
+}
+
+/*
+ * Parse the hunks of diff 'i' and lay out its render lines, unless that is already done.
+ * It is then the most recently used.
+ */
+static bool
+prepare_diff(struct diff_array * da, struct render_line_pair_array * pa, unsigned i)
+{
+    struct diff * d = &da->data[i];
+
+    if (!parse_diff_hunks(d)) {
+        set_error_msg("Failed to parse the hunks of %s", d->post_img_name);
+        return false;
+    }
+
+    bool ok = populate_render_line_arrays(d, &pa->data[i]);
+    account_diff(da, pa, i);
+
+    return ok;
+}
+
+/*
+ * Count diffs into the row index until 'num_diffs' diffs and 'num_rows' rows are counted,
+ * or there are no more diffs. Their hunks are parsed, but not laid out.
+ */
+static bool
+extend_row_index(struct diff_array * da, struct render_line_pair_array const * pa,
+    unsigned num_diffs, unsigned num_rows)
+{
+    if (row_index.size == 0) {
+        if (uint_array_push(&row_index) == NULL) {
+            set_error_msg("Failed to allocate row index");
+            return false;
+        }
+    }
+
+    for (;;) {
+        unsigned counted = row_index.size - 1;
+        unsigned end = row_index.data[counted];
+        if (counted == da->size || (counted >= num_diffs && end >= num_rows))
+            return true;
+
+        struct diff * d = &da->data[counted];
+        if (!parse_diff_hunks(d)) {
+            set_error_msg("Failed to parse the hunks of %s", d->post_img_name);
+            return false;
+        }
+
+        account_diff(da, pa, counted);
+
+        unsigned * next = uint_array_push(&row_index);
+        if (next == NULL) {
+            set_error_msg("Failed to allocate row index");
+            return false;
+        }
+
+        *next = end + DIFF_HEADER_ROWS + count_render_rows(d);
+    }
+}
+
+/* The counted rows of all diffs together */
+static unsigned
+counted_rows(void)
+{
+    return row_index.size > 0 ? row_index.data[row_index.size - 1] : 0;
+}
+
+/* The diff that row 'g' belongs to, which must be counted */
+static unsigned
+diff_at_row(unsigned g)
+{
+    /* the last diff that starts at or before 'g' */
+    unsigned lo = 0;
+    unsigned hi = row_index.size - 1;
+    while (hi - lo > 1) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (row_index.data[mid] <= g)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* Where the shown search hit is in the hunk data of diff 'i', 0 if it is not in that diff */
+static uint32_t
+shown_hit_offset(unsigned i)
+{
+    unsigned const * hits;
+    unsigned count;
+
+    if (!search_active || hit_diff != i || !search_get_hits(i, &hits, &count) || hit_idx >= count)
+        return 0;
+
+    return hits[hit_idx];
+}
+
+/* The number of the shown hit among all hits found so far, counting from 1 */
+static unsigned
+shown_hit_number(void)
+{
+    unsigned n = hit_idx + 1;
+    unsigned const * hits;
+    unsigned count;
+
+    for (unsigned i = 0; i < hit_diff; ++i)
+        if (search_get_hits(i, &hits, &count))
+            n += count;
+
+    return n;
+}
+
+/* The search pattern as it is typed in, or how the search is doing, on the bottom row */
+static void
+draw_search_status(struct vt100_dims const * dims)
+{
+    if (!search_prompt && !search_active && search_error[0] == '\0')
+        return;
+
+    char status[SEARCH_PATTERN_MAX + sizeof(search_error) + 100];
+    char k = prompt_kind == SEARCH_REGEX ? '?' : '/';
+    unsigned num_hits = search_num_hits();
+    bool done = search_is_done();
+
+    if (search_prompt) {
+        snprintf(status, sizeof(status), "%c%s_", k, search_pattern);
+    } else if (!search_active) {
+        snprintf(status, sizeof(status), "%c%s  %s", k, search_pattern, search_error);
+    } else if (hit_diff != NO_DIFF) {
+        snprintf(status, sizeof(status), "%c%s  hit %u of %u%s", k, search_pattern,
+            shown_hit_number(), num_hits, done ? "" : " so far, searching..");
+    } else if (num_hits > 0 || !done) {
+        snprintf(status, sizeof(status), "%c%s  %u hits%s", k, search_pattern, num_hits,
+            done ? "" : " so far, searching..");
+    } else {
+        snprintf(status, sizeof(status), "%c%s  no hits", k, search_pattern);
+    }
+
+    vt100_set_pos(1, dims->rows);
+    if (!search_prompt)
+        vt100_set_yellow_foreground();
+    vt100_write(status, strlen(status), dims->cols - 1);
+    vt100_set_default_colors();
+}
+
+/*
+ * Draw the diffs one after the other from row 'global_start' on, each with its names above
+ * its render lines. Only the diffs that are shown are laid out.
+ */
+static bool
+draw_continuous(struct diff_stream * ds, struct render_line_pair_array * pa)
+{
+    struct diff_array * da = &ds->da;
+    unsigned row = diff0_window.tl.y;
+    unsigned g = global_start;
+
+    shown_max_len_a0 = 0;
+    shown_max_len_a1 = 0;
+
+    try_ret(extend_row_index(da, pa, 0, global_start + (diff0_window.br.y - row)));
+
+    while (row < diff0_window.br.y && g < counted_rows()) {
+        unsigned i = diff_at_row(g);
+        unsigned r = g - row_index.data[i];
+        struct diff * d = &da->data[i];
+
+        if (r < DIFF_HEADER_ROWS) {
+            draw_diff_header_row(d, &diff0_window, &diff1_window, r, row);
+            row++;
+            g++;
+            continue;
+        }
+
+        struct render_line_pair * p = &pa->data[i];
+        try_ret(prepare_diff(da, pa, i));
+        assert(p->num_rows == row_index.data[i + 1] - row_index.data[i] - DIFF_HEADER_ROWS);
+
+        unsigned first = r - DIFF_HEADER_ROWS;
+        unsigned n = MIN(diff0_window.br.y - row, p->num_rows - first);
+        try_ret(layout_window(d, p, first, n));
+        try_ret(highlight_rows(d, p, first, n));
+        account_diff(da, pa, i);
+        uint32_t hit_offset = shown_hit_offset(i);
+        try_ret(draw_render_lines(d, p, 0, &diff0_window, row, first, row + n, hit_offset));
+        try_ret(draw_render_lines(d, p, 1, &diff1_window, row, first, row + n, hit_offset));
+
+        shown_max_len_a0 = MAX(shown_max_len_a0, p->max_len[0]);
+        shown_max_len_a1 = MAX(shown_max_len_a1, p->max_len[1]);
+
+        row += n;
+        g += n;
+    }
+
+    return true;
+}
+
+static bool
+draw_frame(struct diff_stream * ds, struct render_line_pair_array * pa,
+    struct vt100_dims * dims)
+{
+    struct diff_array * da = &ds->da;
+
+    if (is_terminal_too_small(dims)) {
+        vt100_set_pos(1, 1);
+        static const char * const error_msg = "Increase terminal size..";
+        vt100_write(error_msg, strlen(error_msg), dims->cols);
+        return true;
+    }
+
+    calculate_dimensions(dims, &list_window, &diff0_window, &diff1_window);
+
+    draw_list(ds, &list_window);
+
+    draw_search_status(dims);
+
+    if (continuous) {
+        /* the names scroll with the render lines */
+        vt100_scroll_rows(diff0_window.tl.y, diff0_window.br.y - 1, scrolled_lines);
+        return draw_continuous(ds, pa);
+    }
+
+    struct diff * diff = &da->data[diff_idx];
+
+    struct render_line_pair * p = &pa->data[diff_idx];
+
+    /* rather than doing the same work, wait for the worker to finish this diff */
+    placeholder_shown = !p->is_populated && precompute_idx == diff_idx;
+    if (placeholder_shown)
+        return draw_windows(diff, &diff0_window, &diff1_window, NULL, 0);
+
+    try_ret(prepare_diff(da, pa, diff_idx));
+
+    /* only the rows that are shown are laid out, and their changed lines diffed once */
+    unsigned rows = diff0_window.br.y - (diff0_window.tl.y + DIFF_HEADER_ROWS);
+    try_ret(layout_window(diff, p, diff_start, rows));
+    try_ret(highlight_rows(diff, p, diff_start, rows));
+    account_diff(da, pa, diff_idx);
+
+    /* the rows of hunk lines, below the names, can be scrolled by the terminal */
+    vt100_scroll_rows(diff0_window.tl.y + DIFF_HEADER_ROWS, diff0_window.br.y - 1,
+        scrolled_lines);
+
+    try_ret(draw_windows(diff, &diff0_window, &diff1_window, p, shown_hit_offset(diff_idx)));
+
+    return true;
+}
+
+/*
+ * One render line pair for each diff delivered so far.
+ * NOTE: Must be called with the stream lock held
+ */
+static bool
+add_render_line_pairs(struct diff_array const * da, struct render_line_pair_array * pa)
+{
+    while (pa->size < da->size) {
+        if (render_line_pair_array_push(pa) == NULL) {
+            set_error_msg("Failed to allocate render line pair");
+            return false;
+        }
+    }
+
+    while (max_memory != 0 && lru.size < pa->size) {
+        if (lru_node_array_push(&lru) == NULL) {
+            set_error_msg("Failed to allocate render line pair");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* NOTE: Must be called with the stream lock held */
+static bool
+update_display(struct diff_stream * ds, struct render_line_pair_array * pa)
+{
+    struct diff_array * da = &ds->da;
+
+    try_ret(add_render_line_pairs(da, pa));
+
+    shown_diffs = da->size;
+    shown_done = ds->is_done;
+    shown_hits = search_num_hits();
+    shown_search_done = search_is_done();
+
+    struct vt100_dims dims;
+    try_ret(vt100_get_window_size(&dims));
+
+    /* the whole frame is drawn, but only the changes reach the terminal */
+    vt100_begin_frame(&dims);
+    bool ok = draw_frame(ds, pa, &dims);
+    vt100_end_frame();
+
+    scrolled_lines = 0;
+
+    /* what was just drawn is the most recently used and stays */
+    evict_diffs(da, pa);
+
+    return ok;
+}
+
+/* Scroll the list so that it shows 'diff_idx' */
+static void
+show_diff_in_list(void)
+{
+    unsigned list_rows = list_window.br.y - 3;
+
+    if (diff_idx < list_visible_start) {
+        list_visible_start = diff_idx;
+        list_visible_end = diff_idx + list_rows;
+    } else if (diff_idx > list_rows && diff_idx > list_visible_end) {
+        list_visible_end = diff_idx;
+        list_visible_start = diff_idx - list_rows;
+    }
+}
+
+/* Show the diffs from row 'g' on, which must be counted. Its diff is selected in the list. */
+static void
+scroll_continuous(unsigned g)
+{
+    scrolled_lines += (int)g - (int)global_start;
+    global_start = g;
+    diff_idx = diff_at_row(g);
+    show_diff_in_list();
+    redraw = true;
+}
+
+/* Show the hit 'hit_idx' of diff 'hit_diff' a few rows from the top of the windows */
+static bool
+show_hit(struct diff_array * da, struct render_line_pair_array * pa)
+{
+    struct render_line_pair * p = &pa->data[hit_diff];
+    unsigned const * hits;
+    unsigned count;
+
+    search_get_hits(hit_diff, &hits, &count);
+    try_ret(prepare_diff(da, pa, hit_diff));
+
+    unsigned row = find_line_row(&da->data[hit_diff], p, hits[hit_idx]);
+    unsigned top = row - MIN(row, CONTEXT_ROWS);
+
+    if (continuous) {
+        try_ret(extend_row_index(da, pa, hit_diff + 1, 0));
+        scroll_continuous(row_index.data[hit_diff] + DIFF_HEADER_ROWS + top);
+    } else {
+        if (hit_diff != diff_idx) {
+            diff_idx = hit_diff;
+            scrolled_lines = 0;
+            horizontal_offset = 0;
+            show_diff_in_list();
+        } else {
+            scrolled_lines += (int)top - (int)diff_start;
+        }
+
+        diff_start = top;
+    }
+
+    redraw = true;
+    return true;
+}
+
+/*
+ * Go to the next hit, or the previous one if 'search_jump' is -1, from the shown hit or the
+ * start of the shown diff. If the diffs on the way are not searched yet, 'search_jump' stays
+ * set and this is tried again once more of them are. The hits wrap around once every diff
+ * is searched.
+ * NOTE: Must be called with the stream lock held
+ */
+static bool
+jump_to_hit(struct diff_array * da, struct render_line_pair_array * pa)
+{
+    bool done = search_is_done();
+    bool from_hit = hit_diff != NO_DIFF;
+    unsigned i = from_hit ? hit_diff : diff_idx;
+
+    if (i >= da->size) {
+        search_jump = 0;
+        return true;
+    }
+
+    for (unsigned tried = 0; tried <= da->size; ++tried) {
+        unsigned const * hits;
+        unsigned count = 0;
+        if (!search_get_hits(i, &hits, &count) && !done)
+            return true;
+
+        /* the hit to try in this diff, one past the end or -1 if there is none */
+        long k;
+        if (search_jump > 0)
+            k = from_hit && tried == 0 ? (long)hit_idx + 1 : 0;
+        else
+            k = from_hit && tried == 0 ? (long)hit_idx - 1 : (long)count - 1;
+
+        if (k >= 0 && k < count) {
+            hit_diff = i;
+            hit_idx = k;
+            search_jump = 0;
+            return show_hit(da, pa);
+        }
+
+        if (search_jump > 0) {
+            if (i + 1 < da->size)
+                i++;
+            else if (done)
+                i = 0;
+            else
+                return true;
+        } else {
+            if (i > 0)
+                i--;
+            else if (done)
+                i = da->size - 1;
+            else
+                return true;
+        }
+    }
+
+    /* there are no hits */
+    search_jump = 0;
+    redraw = true;
+    return true;
+}
+
+/* Type in the search pattern, Enter starts the search and Escape leaves it */
+static void
+handle_prompt_key(void)
+{
+    char c = vt100_key_char();
+
+    if (c == '\r' || c == '\n') {
+        search_prompt = false;
+        search_start_requested = search_pattern_len > 0;
+    } else if (c == '\x1b') {
+        search_prompt = false;
+    } else if (c == 0x7f || c == '\b') {
+        /* a whole UTF-8 character */
+        while (search_pattern_len > 0
+                && (search_pattern[--search_pattern_len] & 0xc0) == 0x80)
+            ;
+    } else if (!is_control_char(c) && search_pattern_len < SEARCH_PATTERN_MAX) {
+        search_pattern[search_pattern_len++] = c;
+    }
+
+    search_pattern[search_pattern_len] = '\0';
+    redraw = true;
+}
+
+/* The keys of searching, '*handled' is false for the keys that do what they always do */
+static bool
+handle_search_key(enum vt100_key_type key, struct diff_array * da,
+    struct render_line_pair_array * pa, bool * handled)
+{
+    *handled = true;
+
+    if (search_prompt && key != KEY_TYPE_ERROR) {
+        handle_prompt_key();
+        return true;
+    }
+
+    switch (key) {
+    case KEY_TYPE_SEARCH:
+    case KEY_TYPE_SEARCH_REGEX:
+        search_prompt = true;
+        prompt_kind = key == KEY_TYPE_SEARCH ? SEARCH_LITERAL : SEARCH_REGEX;
+        search_pattern_len = 0;
+        search_pattern[0] = '\0';
+        search_error[0] = '\0';
+        redraw = true;
+        break;
+    case KEY_TYPE_ESCAPE:
+        if (search_active || search_error[0] != '\0') {
+            search_stop_requested = search_active;
+            search_active = false;
+            search_error[0] = '\0';
+            hit_diff = NO_DIFF;
+            search_jump = 0;
+            redraw = true;
+        }
+        break;
+    case KEY_TYPE_NEXT_DIFF:
+    case KEY_TYPE_PREV_DIFF:
+        if (!search_active) {
+            *handled = false;
+            break;
+        }
+
+        search_jump = key == KEY_TYPE_NEXT_DIFF ? 1 : -1;
+        return jump_to_hit(da, pa);
+    default:
+        *handled = false;
+    }
+
+    return true;
+}
+
+/*
+ * Start searching for the pattern that was typed in, from the shown diff on.
+ * NOTE: Must be called without the stream lock held
+ */
+static void
+start_search(struct diff_stream * ds)
+{
+    char error[sizeof(search_error)];
+    bool ok = search_start(ds, search_pattern, prompt_kind, diff_idx, error, sizeof(error));
+
+    pthread_mutex_lock(&ds->lock);
+
+    search_active = ok;
+    hit_diff = NO_DIFF;
+    search_jump = ok ? 1 : 0;
+    snprintf(search_error, sizeof(search_error), "%s", ok ? "" : error);
+    redraw = true;
+
+    pthread_mutex_unlock(&ds->lock);
+
+    /* go to the first hit, or show the error */
+    write(wake_fds[1], "", 1);
+}
+
+/*
+ * The first change of 'p' that starts after row 'row' if 'next', otherwise the last one that
+ * starts before it. Returns false if there is none.
+ */
+static bool
+find_change(struct render_line_pair const * p, long row, bool next, unsigned * change)
+{
+    struct row_block const * blocks = p->blocks.data;
+
+    /* the first block after 'row', or at it if looking back */
+    unsigned lo = 0;
+    unsigned hi = p->blocks.size;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if ((long)blocks[mid].row < row || (next && blocks[mid].row == row))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    /* changes are at most a few blocks apart */
+    if (next) {
+        while (lo < p->blocks.size && blocks[lo].type != ROW_BLOCK_CHANGE)
+            ++lo;
+        if (lo == p->blocks.size)
+            return false;
+
+        *change = blocks[lo].row;
+    } else {
+        while (lo > 0 && blocks[lo - 1].type != ROW_BLOCK_CHANGE)
+            --lo;
+        if (lo == 0)
+            return false;
+
+        *change = blocks[lo - 1].row;
+    }
+
+    return true;
+}
+
+/* Scroll the shown diff to the next or previous change, with a few rows above it */
+static bool
+jump_to_change(struct diff_array * da, struct render_line_pair_array * pa, bool next)
+{
+    struct render_line_pair * p = &pa->data[diff_idx];
+    try_ret(prepare_diff(da, pa, diff_idx));
+
+    unsigned change;
+    if (!find_change(p, (long)diff_start + CONTEXT_ROWS, next, &change))
+        return true;
+
+    unsigned top = change - MIN(change, CONTEXT_ROWS);
+    if (top != diff_start) {
+        scrolled_lines += (int)top - (int)diff_start;
+        diff_start = top;
+        redraw = true;
+    }
+
+    return true;
+}
+
+/*
+ * Scroll to the next or previous change in continuous mode, which might be in another
+ * diff. Only the diffs on the way there are laid out.
+ */
+static bool
+jump_to_change_continuous(struct diff_array * da, struct render_line_pair_array * pa,
+    bool next)
+{
+    for (unsigned i = diff_idx; i < da->size; next ? ++i : --i) {
+        try_ret(extend_row_index(da, pa, i + 1, 0));
+        try_ret(prepare_diff(da, pa, i));
+
+        /* where the diffs are scrolled to now, as a row of diff i */
+        unsigned base = row_index.data[i] + DIFF_HEADER_ROWS;
+        long row = (long)global_start + CONTEXT_ROWS - base;
+
+        unsigned change;
+        if (find_change(&pa->data[i], row, next, &change)) {
+            unsigned g = base + change;
+            scroll_continuous(g - MIN(g, CONTEXT_ROWS));
+            return true;
+        }
+
+        if (!next && i == 0)
+            break;
+    }
+
+    return true;
 }
 
-static
-bool is_terminal_too_small(struct vt100_dims * d)
+/* The keys that move around differently when the diffs are shown one after the other */
+static bool
+handle_continuous_key(enum vt100_key_type key, struct diff_array * da,
+    struct render_line_pair_array * pa, bool * handled)
 {
-    /* we need at least 10 width list, 20 width diff A and 20 width diff B */
-    return d->cols < 101 || d->rows < 21;
+    unsigned rows = diff0_window.br.y - diff0_window.tl.y;
+    *handled = true;
+
+    switch (key) {
+    case KEY_TYPE_PREV_DIFF:
+        if (diff_idx > 0) {
+            scroll_continuous(row_index.data[diff_idx - 1]);
+            scrolled_lines = 0;
+            horizontal_offset = 0;
+        }
+        break;
+    case KEY_TYPE_NEXT_DIFF:
+        try_ret(extend_row_index(da, pa, diff_idx + 2, 0));
+        if (diff_idx + 1 < row_index.size - 1) {
+            scroll_continuous(row_index.data[diff_idx + 1]);
+            scrolled_lines = 0;
+            horizontal_offset = 0;
+        }
+        break;
+    case KEY_TYPE_PREV_CHANGE:
+    case KEY_TYPE_NEXT_CHANGE:
+        try_ret(jump_to_change_continuous(da, pa, key == KEY_TYPE_NEXT_CHANGE));
+        break;
+    case KEY_TYPE_MOVE_DIFFS_UP:
+        if (global_start > 0)
+            scroll_continuous(global_start - MIN(global_start, MOVE_DIFF_LINES));
+        break;
+    case KEY_TYPE_MOVE_DIFFS_DOWN:
+        /* stop when the last rows are well up the windows */
+        try_ret(extend_row_index(da, pa, 0, global_start + rows));
+        if (global_start + rows - MOVE_DIFF_LINES < counted_rows())
+            scroll_continuous(global_start + MOVE_DIFF_LINES);
+        break;
+    case KEY_TYPE_MOVE_DIFFS_RIGHT: {
+        unsigned diff0_offs = (diff0_window.br.x - diff0_window.tl.x) - LINE_NBR_WIDTH;
+        unsigned diff1_offs = (diff1_window.br.x - diff1_window.tl.x) - LINE_NBR_WIDTH;
+        if (horizontal_offset + diff0_offs < shown_max_len_a0 ||
+            horizontal_offset + diff1_offs < shown_max_len_a1) {
+            horizontal_offset++;
+            redraw = true;
+        }
+        break;
+    }
+    default:
+        *handled = false;
+    }
+
+    return true;
 }
 
 static bool
-update_display(struct diff_array * da, struct render_line_pair_array * pa)
+handle_key(enum vt100_key_type key, struct diff_array * da, struct render_line_pair_array * pa,
+    bool * quit)
 {
-    struct vt100_dims dims;
-    try_ret(vt100_get_window_size(&dims));
-
-    vt100_clear_screen();
+    struct render_line_pair * p  = &pa->data[diff_idx];
 
-    if (is_terminal_too_small(&dims)) {
-        vt100_set_pos(1, 1);
-        static const char * const error_msg = "Increase terminal size..";
-        vt100_write(error_msg, strlen(error_msg), dims.cols);
+    bool handled;
+    try_ret(handle_search_key(key, da, pa, &handled));
+    if (handled)
         return true;
+
+    if (continuous) {
+        try_ret(handle_continuous_key(key, da, pa, &handled));
+        if (handled)
+            return true;
     }
 
-    calculate_dimensions(&dims, &list_window, &diff0_window, &diff1_window);
+    switch (key) {
+    case KEY_TYPE_NONE:
+    case KEY_TYPE_UNKNOWN:
+        break;
+    case KEY_TYPE_ERROR:
+        set_error_msg("Reading key failed");
+        return false;
+    case KEY_TYPE_EXIT:
+        *quit = true;
+        return true;
+    case KEY_TYPE_PREV_DIFF:
+        if (diff_idx > 0) {
+            diff_idx--;
 
-    draw_list(da, &list_window);
+            diff_start = 0;
+            scrolled_lines = 0;
+            horizontal_offset = 0;
 
-    struct diff * diff = &da->data[diff_idx];
+            if (diff_idx < list_visible_start) {
+                list_visible_start = diff_idx;
 
-    struct render_line_pair * p = &pa->data[diff_idx];
+                list_visible_end = diff_idx + (list_window.br.y - 3);
+            }
+
+            redraw = true;
+        }
+        break;
+    case KEY_TYPE_NEXT_DIFF:
+        if (diff_idx < da->size - 1) {
+            diff_idx++;
 
-    try_ret(populate_render_line_arrays(diff, p));
+            diff_start = 0;
+            scrolled_lines = 0;
+            horizontal_offset = 0;
+
+            if (diff_idx > list_window.br.y - 3) { // because the list from third row
+
+                if (diff_idx > list_visible_end)
+                    list_visible_end = diff_idx;
+
+                list_visible_start = list_visible_end - (list_window.br.y - 3);
+            }
 
-    try_ret(draw_windows(diff, &diff0_window, &diff1_window, p));
+            redraw = true;
+        }
+        break;
+    case KEY_TYPE_PREV_CHANGE:
+    case KEY_TYPE_NEXT_CHANGE:
+        try_ret(jump_to_change(da, pa, key == KEY_TYPE_NEXT_CHANGE));
+        break;
+    case KEY_TYPE_SEARCH:
+    case KEY_TYPE_SEARCH_REGEX:
+    case KEY_TYPE_ESCAPE:
+        break;
+    case KEY_TYPE_MOVE_DIFFS_UP:
+        if (diff_start > 0) {
+            /* a search hit or a change might have put the top at any row */
+            unsigned n = MIN(diff_start, MOVE_DIFF_LINES);
+            diff_start -= n;
+            scrolled_lines -= (int)n;
+            redraw = true;
+        }
+        break;
+    case KEY_TYPE_MOVE_DIFFS_DOWN:
+        /* a key earlier in the same batch might have moved to a diff that is not shown yet */
+        try_ret(prepare_diff(da, pa, diff_idx));
+
+        /* diff0_window and diff1_window are the same height */
+        assert(diff0_window.br.y == diff1_window.br.y);
+        if (diff_start + diff0_window.br.y - 10 < p->num_rows) {
+            diff_start += MOVE_DIFF_LINES;
+            scrolled_lines += MOVE_DIFF_LINES;
+            redraw = true;
+        }
+        break;
+    case KEY_TYPE_MOVE_DIFFS_LEFT:
+        if (horizontal_offset > 0) {
+            horizontal_offset--;
+            redraw = true;
+        }
+        break;
+    case KEY_TYPE_MOVE_DIFFS_RIGHT: {
+        try_ret(prepare_diff(da, pa, diff_idx));
+
+        unsigned diff0_offs = (diff0_window.br.x - diff0_window.tl.x) - LINE_NBR_WIDTH;
+        unsigned diff1_offs = (diff1_window.br.x - diff1_window.tl.x) - LINE_NBR_WIDTH;
+        if (horizontal_offset + diff0_offs < p->max_len[0] ||
+            horizontal_offset + diff1_offs < p->max_len[1]) {
+            horizontal_offset++;
+            redraw = true;
+        }
+        break;
+    }
+    }
 
     return true;
 }
 
+/* Whether there is room in the list for diffs delivered since the last frame */
 static bool
-enter_loop(int fd, struct diff_array * da, struct render_line_pair_array * pa)
+list_has_room(void)
 {
-    for (;;) {
-        enum vt100_key_type key = vt100_read_key(fd);
+    /* the same condition as for the status row in draw_list */
+    return shown_diffs - list_visible_start + 3 <= list_window.br.y;
+}
 
-        struct render_line_pair * p  = &pa->data[diff_idx];
+/* Empty the wake-up pipe, whatever woke us up is looked at afterwards */
+static void
+drain_wake_pipe(void)
+{
+    char buf[64];
+    while (read(wake_fds[0], buf, sizeof(buf)) > 0)
+        ;
+}
 
-        switch (key) {
-        case KEY_TYPE_NONE:
-        case KEY_TYPE_UNKNOWN:
-            break;
-        case KEY_TYPE_ERROR:
-            set_error_msg("Reading key failed");
-            return false;
-        case KEY_TYPE_EXIT:
-            return true;
-        case KEY_TYPE_PREV_DIFF:
-            if (diff_idx > 0) {
-                diff_idx--;
+/*
+ * Handle every key the terminal has for us, then draw at most one frame. Holding down a key
+ * thus costs a frame per batch of keys instead of a frame per key.
+ */
+static bool
+handle_events(int fd, struct diff_stream * ds, struct render_line_pair_array * pa, bool * quit)
+{
+    pthread_mutex_lock(&ds->lock);
 
-                diff_start = 0;
-                horizontal_offset = 0;
+    /* anything the parser delivers from now on wakes us up again */
+    ds->notify_pending = false;
 
-                if (diff_idx < list_visible_start) {
-                    list_visible_start = diff_idx;
+    if (precompute_error[0] != '\0') {
+        memcpy(error_msg, precompute_error, sizeof(error_msg));
+        precompute_error[0] = '\0';
+    }
 
-                    list_visible_end = diff_idx + (list_window.br.y - 3);
-                }
+    bool ok = add_render_line_pairs(&ds->da, pa);
 
-                redraw = true;
-            }
-            break;
-        case KEY_TYPE_NEXT_DIFF:
-            if (diff_idx < da->size - 1) {
-                diff_idx++;
+    /* a frame that still waits for the terminal to take the one before */
+    bool deferred = redraw;
+    redraw = false;
 
-                diff_start = 0;
-                horizontal_offset = 0;
+    enum vt100_key_type key;
+    while (ok && !*quit && (key = vt100_read_key(fd)) != KEY_TYPE_NONE)
+        ok = handle_key(key, &ds->da, pa, quit);
 
-                if (diff_idx > list_window.br.y - 3) { // because the list from third row
+    if (window_changed) {
+        window_changed = 0;
+        redraw = true;
+    }
 
-                    if (diff_idx > list_visible_end)
-                        list_visible_end = diff_idx;
+    /* the parser might have delivered more diffs */
+    if ((ds->da.size != shown_diffs && list_has_room()) || ds->is_done != shown_done)
+        redraw = true;
 
-                    list_visible_start = list_visible_end - (list_window.br.y - 3);
-                }
+    /* the search might have got to the hit we wait for, or found more */
+    if (ok && search_jump != 0)
+        ok = jump_to_hit(&ds->da, pa);
+    if (search_active && (search_num_hits() != shown_hits || search_is_done() != shown_search_done))
+        redraw = true;
 
-                redraw = true;
-            }
-            break;
-        case KEY_TYPE_PREV_CHANGE:
-        case KEY_TYPE_NEXT_CHANGE:
-            break;
-        case KEY_TYPE_MOVE_DIFFS_UP:
-            if (diff_start > 0) {
-                diff_start -= MOVE_DIFF_LINES;
-                redraw = true;
-            }
-            break;
-        case KEY_TYPE_MOVE_DIFFS_DOWN:
-            /* diff0_window and diff1_window are the same height and a0 and a1 are the same size */
-            assert(diff0_window.br.y == diff1_window.br.y);
-            assert(p->a0.size == p->a1.size);
-            if (diff_start + diff0_window.br.y - 10 < p->a0.size) {
-                diff_start += MOVE_DIFF_LINES;
-                redraw = true;
-            }
-            break;
-        case KEY_TYPE_MOVE_DIFFS_LEFT:
-            if (horizontal_offset > 0) {
-                horizontal_offset--;
-                redraw = true;
-            }
-            break;
-        case KEY_TYPE_MOVE_DIFFS_RIGHT: {
-            unsigned diff0_offs = (diff0_window.br.x - diff0_window.tl.x) - LINE_NBR_WIDTH;
-            unsigned diff1_offs = (diff1_window.br.x - diff1_window.tl.x) - LINE_NBR_WIDTH;
-            if (horizontal_offset + diff0_offs < p->max_len_a0 ||
-                horizontal_offset + diff1_offs < p->max_len_a1) {
-                horizontal_offset++;
-                redraw = true;
-            }
-            break;
-        }
+    /* the waiting frame is replaced by this one, it is never drawn */
+    if (deferred && redraw)
+        dropped_frames++;
+    redraw = redraw || deferred;
+
+    /*
+     * While the terminal is still busy with the last frame, a new one would be out of date
+     * by the time it got there. Wait, and draw the state as it is by then.
+     */
+    bool drawn = false;
+    if (ok && !*quit && redraw && vt100_queued() == 0) {
+        redraw = false;
+        ok = update_display(ds, pa);
+        drawn = ok;
+    }
+
+    /* the precompute thread picks what to lay out next from where we are now */
+    pthread_cond_broadcast(&ds->cond);
+
+    pthread_mutex_unlock(&ds->lock);
+
+    /* the terminal might be slow to take the frame, don't keep the parser waiting */
+    if (drawn)
+        vt100_flush_frame();
+
+    /* the workers of a running search need the lock to stop */
+    if (search_stop_requested) {
+        search_stop_requested = false;
+        search_stop();
+    }
+
+    if (search_start_requested) {
+        search_start_requested = false;
+        start_search(ds);
+    }
+
+    return ok;
+}
+
+static bool
+enter_loop(int fd, struct diff_stream * ds, struct render_line_pair_array * pa)
+{
+    struct pollfd fds[] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = wake_fds[0], .events = POLLIN },
+        { .fd = -1, .events = POLLOUT },
+    };
+
+    for (;;) {
+        /* only wait for the terminal to take more output if there is some */
+        fds[2].fd = vt100_queued() > 0 ? STDOUT_FILENO : -1;
+
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            set_error_msg("Waiting for input failed: %s", strerror(errno));
+            return false;
         }
 
-        if (redraw) {
-            redraw = false;
-            try_ret(update_display(da, pa));
+        if ((fds[0].revents | fds[2].revents) & (POLLERR | POLLHUP | POLLNVAL)) {
+            set_error_msg("Lost the terminal");
+            return false;
         }
+
+        if (fds[2].revents & POLLOUT)
+            vt100_send_queued();
+
+        if (fds[1].revents & POLLIN)
+            drain_wake_pipe();
+
+        bool quit = false;
+        try_ret(handle_events(fd, ds, pa, &quit));
+
+        if (quit)
+            return true;
     }
 
     return true;
@@ -635,8 +2145,35 @@ catch_window_change_signal(int signo)
 {
     if (signo == SIGWINCH) {
         /* terminal resized */
-        redraw = true;
+        int saved_errno = errno;
+        window_changed = 1;
+        write(wake_fds[1], "", 1);
+        errno = saved_errno;
+    }
+}
+
+static bool
+open_wake_pipe(void)
+{
+    if (pipe(wake_fds) != 0) {
+        set_error_msg("Failed to create pipe: %s", strerror(errno));
+        return false;
+    }
+
+    for (unsigned i = 0; i < 2; ++i) {
+        fcntl(wake_fds[i], F_SETFL, fcntl(wake_fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(wake_fds[i], F_SETFD, FD_CLOEXEC);
     }
+
+    return true;
+}
+
+static void
+close_wake_pipe(void)
+{
+    close(wake_fds[0]);
+    close(wake_fds[1]);
+    wake_fds[0] = wake_fds[1] = -1;
 }
 
 static void
@@ -648,6 +2185,10 @@ init_vt100(int fd)
     vt100_enable_raw_mode(fd);
 
     vt100_hide_cursor();
+
+    vt100_flush();
+
+    vt100_set_async_output(true);
 }
 
 static void
@@ -662,32 +2203,332 @@ reset_vt100(int fd)
 
     /* this might not work in some terminals */
     vt100_leave_alternate_screen_buffer();
+
+    vt100_set_async_output(false);
+}
+
+static void
+release_render_line_pairs(struct render_line_pair_array * pa)
+{
+    for (unsigned i = 0; i < pa->size; ++i)
+        release_render_line_pair(&pa->data[i]);
+
+    render_line_pair_array_release(pa);
+}
+
+static bool
+needs_precompute(struct render_line_pair const * p)
+{
+    return !p->is_populated && !p->skip_precompute;
+}
+
+/*
+ * The diff to lay out next, or NO_DIFF if there is none.
+ * NOTE: Must be called with the stream lock held
+ */
+static unsigned
+pick_diff_to_precompute(struct render_line_pair_array const * pa)
+{
+    /* the user is likely to look at the diffs next to the shown one */
+    for (unsigned dist = 0; dist <= PRECOMPUTE_NEIGHBOURS; ++dist) {
+        if (diff_idx + dist < pa->size && needs_precompute(&pa->data[diff_idx + dist]))
+            return diff_idx + dist;
+        if (dist > 0 && dist <= diff_idx && needs_precompute(&pa->data[diff_idx - dist]))
+            return diff_idx - dist;
+    }
+
+    /*
+     * In continuous mode only the diffs around the shown rows are laid out, and with a
+     * memory budget the rest are only laid out while there is plenty of it left.
+     */
+    if (continuous || (max_memory != 0 && used_memory >= max_memory / 2))
+        return NO_DIFF;
+
+    while (precompute_next < pa->size && !needs_precompute(&pa->data[precompute_next]))
+        precompute_next++;
+
+    return precompute_next < pa->size ? precompute_next : NO_DIFF;
+}
+
+/*
+ * Hand over what the worker made of diff 'i', unless the render loop got there first.
+ * NOTE: Must be called with the stream lock held
+ */
+static void
+adopt_precomputed(struct diff_stream * ds, struct render_line_pair_array * pa, unsigned i,
+    struct diff * d, bool parsed_here, struct render_line_pair * p, bool ok, char const * error)
+{
+    struct diff * dst_d = &ds->da.data[i];
+    struct render_line_pair * dst_p = &pa->data[i];
+
+    if (ok && parsed_here && !dst_d->is_parsed) {
+        dst_d->ha = d->ha;
+        dst_d->hla = d->hla;
+        dst_d->is_parsed = true;
+    } else if (parsed_here) {
+        release_diff_hunks(d);
+    }
+
+    /* the render lines only refer to the hunk data, so they go with either parse */
+    if (ok && !dst_p->is_populated) {
+        *dst_p = *p;
+    } else {
+        release_render_line_pair(p);
+        dst_p->skip_precompute = !ok;
+    }
+
+    if (!ok)
+        snprintf(precompute_error, sizeof(precompute_error), "%s", error);
+
+    account_diff(&ds->da, pa, i);
+
+    if (i == diff_idx && placeholder_shown) {
+        redraw = true;
+        write(wake_fds[1], "", 1);
+    }
+}
+
+struct precompute_ctx {
+    struct diff_stream * ds;
+    struct render_line_pair_array * pa;
+};
+
+static void *
+precompute_render_lines(void * arg)
+{
+    struct precompute_ctx * ctx = arg;
+    struct diff_stream * ds = ctx->ds;
+
+    char error[sizeof(error_msg)];
+    error_buf = error;
+
+    pthread_mutex_lock(&ds->lock);
+
+    while (!precompute_stop) {
+        unsigned i = pick_diff_to_precompute(ctx->pa);
+        if (i == NO_DIFF) {
+            /* new diffs, or the user moved on */
+            pthread_cond_wait(&ds->cond, &ds->lock);
+            continue;
+        }
+
+        /* work on a copy, the diff array might be reallocated while we don't hold the lock */
+        struct diff d = ds->da.data[i];
+        bool parsed_here = !d.is_parsed;
+        struct render_line_pair p = {0};
+        precompute_idx = i;
+        error[0] = '\0';
+
+        pthread_mutex_unlock(&ds->lock);
+
+        bool ok = parse_diff_hunks(&d) && populate_render_line_arrays(&d, &p)
+            && layout_window(&d, &p, 0, 1);
+
+        pthread_mutex_lock(&ds->lock);
+
+        precompute_idx = NO_DIFF;
+        adopt_precomputed(ds, ctx->pa, i, &d, parsed_here, &p, ok, error);
+    }
+
+    pthread_mutex_unlock(&ds->lock);
+    return NULL;
+}
+
+static void
+start_precompute(struct precompute_ctx * ctx)
+{
+    /* without the thread every diff is laid out when it is shown */
+    precompute_started = pthread_create(&precompute_thread, NULL, precompute_render_lines,
+        ctx) == 0;
+}
+
+static void
+stop_precompute(struct diff_stream * ds)
+{
+    if (!precompute_started)
+        return;
+
+    pthread_mutex_lock(&ds->lock);
+    precompute_stop = true;
+    pthread_cond_broadcast(&ds->cond);
+    pthread_mutex_unlock(&ds->lock);
+
+    pthread_join(precompute_thread, NULL);
+    precompute_started = false;
+}
+
+static void
+print_frame_stats(void)
+{
+    struct vt100_frame_stats s;
+    vt100_get_frame_stats(&s);
+
+    if (s.frames == 0)
+        return;
+
+    fprintf(stderr, "frames: %u, bytes/frame: %llu avg %zu max, writes/frame: %.1f avg %u max, "
+        "dropped frames: %u\n", s.frames, s.bytes / s.frames, s.max_frame_bytes,
+        (double)s.writes / s.frames, s.max_frame_writes, dropped_frames);
+
+    if (max_memory != 0)
+        fprintf(stderr, "evicted diffs: %u, memory in use: %zu bytes\n", evicted_diffs,
+            used_memory);
 }
 
 bool
-render(int fd, struct diff_array * da)
+render(int fd, struct diff_stream * ds, struct render_options const * o)
 {
+    tab_width = o->tab_width;
+    highlight_mode = o->highlight;
+    continuous = o->continuous;
+    max_memory = o->max_memory;
+
+    if (!open_wake_pipe()) {
+        print_error_msg();
+        return false;
+    }
+
     init_vt100(fd);
 
     signal(SIGWINCH, catch_window_change_signal);
+    parse_stdin_set_notify_fd(ds, wake_fds[1]);
 
-    /* pre allocate array data */
     struct render_line_pair_array pa = {0};
-    for (unsigned i = 0; i < da->size; ++i)
-        alloc_render_line_pair(&pa);
 
-    if (!update_display(da, &pa)) {
-        reset_vt100(fd);
+    pthread_mutex_lock(&ds->lock);
+    bool ok = update_display(ds, &pa);
+    pthread_mutex_unlock(&ds->lock);
+
+    struct precompute_ctx ctx = { .ds = ds, .pa = &pa };
+
+    if (ok) {
+        vt100_flush_frame();
+        start_precompute(&ctx);
+        ok = enter_loop(fd, ds, &pa);
+    }
+
+    search_stop();
+    stop_precompute(ds);
+
+    /* the parser might still be running and must not write to a closed pipe */
+    parse_stdin_set_notify_fd(ds, -1);
+    signal(SIGWINCH, SIG_DFL);
+    close_wake_pipe();
+
+    reset_vt100(fd);
+    release_render_line_pairs(&pa);
+    uint_array_release(&row_index);
+    lru_node_array_release(&lru);
+
+    if (!ok) {
         print_error_msg();
         return false;
     }
 
-    if (!enter_loop(fd, da, &pa)) {
-        reset_vt100(fd);
+    if (o->show_frame_stats)
+        print_frame_stats();
+
+    return true;
+}
+
+/* Print the rows of a diff, PRINT_ROWS at a time, after the names above them */
+static bool
+print_diff(struct diff const * d, struct render_line_pair * p, struct window * diff0,
+    struct window * diff1, unsigned width, bool colors)
+{
+    unsigned total = DIFF_HEADER_ROWS + p->num_rows;
+
+    for (unsigned first = 0; first < total; first += PRINT_ROWS) {
+        unsigned n = MIN(total - first, PRINT_ROWS);
+
+        /* a frame of just the rows to print, most diffs are short */
+        vt100_begin_frame(&(struct vt100_dims) { .rows = n, .cols = width });
+
+        for (unsigned r = first; r < MIN(DIFF_HEADER_ROWS, first + n); ++r)
+            draw_diff_header_row(d, diff0, diff1, r, r - first + 1);
+
+        /* the frame row and the diff row the render lines start at */
+        unsigned row = first < DIFF_HEADER_ROWS ? DIFF_HEADER_ROWS - first : 0;
+        unsigned start = first < DIFF_HEADER_ROWS ? 0 : first - DIFF_HEADER_ROWS;
+
+        if (row < n) {
+            try_ret(layout_window(d, p, start, n - row));
+            try_ret(highlight_rows(d, p, start, n - row));
+            try_ret(draw_render_lines(d, p, 0, diff0, row + 1, start, n + 1, 0));
+            try_ret(draw_render_lines(d, p, 1, diff1, row + 1, start, n + 1, 0));
+        }
+
+        if (!vt100_end_frame_as_text(n, colors)) {
+            set_error_msg("Failed to allocate frame");
+            return false;
+        }
+
+        vt100_flush();
+    }
+
+    return true;
+}
+
+bool
+render_print(struct diff_stream * ds, struct render_options const * o)
+{
+    tab_width = o->tab_width;
+    highlight_mode = o->highlight;
+
+    /* the windows are laid out like on the screen, without the list of diffs */
+    unsigned window_width = (o->width - 1) / 2;
+    struct window diff0 = {
+        .tl = { .x = 1, .y = 1 },
+        .br = { .x = 1 + window_width, .y = PRINT_ROWS + 1 }
+    };
+    struct window diff1 = {
+        .tl = { .x = diff0.br.x + 1, .y = 1 },
+        .br = { .x = diff0.br.x + 1 + window_width, .y = PRINT_ROWS + 1 }
+    };
+
+    bool ok = true;
+
+    for (unsigned i = 0; ok; ++i) {
+        pthread_mutex_lock(&ds->lock);
+        while (i >= ds->da.size && !ds->is_done)
+            pthread_cond_wait(&ds->cond, &ds->lock);
+
+        bool is_done = i >= ds->da.size;
+        struct diff d = is_done ? (struct diff) {0} : ds->da.data[i];
+        pthread_mutex_unlock(&ds->lock);
+
+        if (is_done)
+            break;
+
+        /* the diff is dropped once it is printed, so memory doesn't grow with the input */
+        bool parsed_here = !d.is_parsed;
+        struct render_line_pair p = {0};
+
+        if (!parse_diff_hunks(&d)) {
+            set_error_msg("Failed to parse the hunks of %s", d.post_img_name);
+            ok = false;
+        } else {
+            if (i > 0)
+                vt100_write("\n", 1, 1);
+
+            ok = populate_render_line_arrays(&d, &p)
+                && print_diff(&d, &p, &diff0, &diff1, o->width, o->colors);
+        }
+
+        release_render_line_pair(&p);
+        if (parsed_here)
+            release_diff_hunks(&d);
+
+        if (ok)
+            parse_stdin_release_input(ds, i);
+    }
+
+    vt100_flush();
+
+    if (!ok) {
         print_error_msg();
         return false;
     }
 
-    reset_vt100(fd);
     return true;
 }
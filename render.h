@@ -2,9 +2,39 @@
 #define _NADIFF_RENDER_H_
 
 #include "types.h"
+#include "parse.h"
+#include "line_diff.h"
 
+struct render_options {
+    /* print the bytes and writes of the frames on exit */
+    bool show_frame_stats;
+
+    /* columns between tab stops */
+    unsigned tab_width;
+
+    /* what changes within changed lines are highlighted as */
+    enum line_diff_mode highlight;
+
+    /* show all diffs one after the other instead of one at a time */
+    bool continuous;
+
+    /* the bytes the parsed hunks and render lines of the diffs may take, 0 for no limit */
+    size_t max_memory;
+
+    /* the columns render_print() prints the diffs side by side in, and if it uses colors */
+    unsigned width;
+    bool colors;
+};
+
+bool
+render(int fd, struct diff_stream * ds, struct render_options const * o);
+
+/*
+ * Print every diff of the stream side by side to stdout instead of showing them, one diff
+ * at a time, for output that is not a terminal.
+ */
 bool
-render(int fd, struct diff_array * da);
+render_print(struct diff_stream * ds, struct render_options const * o);
 
 
 #endif
@@ -0,0 +1,446 @@
+#define _GNU_SOURCE /* memmem() */
+#include "scan.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+#define HAS_PREFIX(data, len, lit) \
+    ((len) >= sizeof(lit) - 1 && memcmp((data), (lit), sizeof(lit) - 1) == 0)
+
+enum line_kind
+classify_line(char const * data, unsigned len)
+{
+    if (len == 0)
+        return LINE_KIND_OTHER;
+
+    switch (data[0]) {
+    case '+':
+        return LINE_KIND_POST;
+    case '-':
+        return LINE_KIND_PRE;
+    case ' ':
+        return LINE_KIND_NEUTRAL;
+    case '@':
+        if (len >= 2 && data[1] == '@')
+            return LINE_KIND_HUNK_HEADER;
+        break;
+    case 'd':
+        if (HAS_PREFIX(data, len, DIFF_HEADER_PREFIX))
+            return LINE_KIND_DIFF_HEADER;
+        if (HAS_PREFIX(data, len, "delete"))
+            return LINE_KIND_DELETED;
+        if (HAS_PREFIX(data, len, "dissimilarity index"))
+            return LINE_KIND_DISSIMILARITY;
+        break;
+    case 'o':
+        if (HAS_PREFIX(data, len, "old mode"))
+            return LINE_KIND_OLD_MODE;
+        break;
+    case 'n':
+        if (HAS_PREFIX(data, len, "new mode"))
+            return LINE_KIND_NEW_MODE;
+        if (HAS_PREFIX(data, len, "new file"))
+            return LINE_KIND_NEW_FILE;
+        break;
+    case 'c':
+        if (HAS_PREFIX(data, len, "copy from"))
+            return LINE_KIND_COPY_FROM;
+        if (HAS_PREFIX(data, len, "copy to"))
+            return LINE_KIND_COPY_TO;
+        break;
+    case 'r':
+        if (HAS_PREFIX(data, len, "rename from"))
+            return LINE_KIND_RENAME_FROM;
+        if (HAS_PREFIX(data, len, "rename to"))
+            return LINE_KIND_RENAME_TO;
+        break;
+    case 's':
+        if (HAS_PREFIX(data, len, "similarity index"))
+            return LINE_KIND_SIMILARITY;
+        break;
+    case 'i':
+        if (HAS_PREFIX(data, len, "index"))
+            return LINE_KIND_INDEX;
+        break;
+    case 'B':
+        /* TODO Verify that this is the only format of Binary file output. */
+        if (HAS_PREFIX(data, len, "Binary files "))
+            return LINE_KIND_BINARY;
+        break;
+    }
+
+    return LINE_KIND_OTHER;
+}
+
+/* Returns false when the batch is full */
+static inline bool
+push_line(struct line_batch * b, char const * start, char const * nl)
+{
+    /* NOTE: lines longer than 4 GB are cut */
+    size_t len = nl - start;
+    if (len > UINT32_MAX)
+        len = UINT32_MAX;
+
+    unsigned i = b->size++;
+    b->start[i] = start - b->base;
+    b->len[i] = len;
+    b->kind[i] = classify_line(start, len);
+
+    /* offsets in a batch are 32 bits */
+    return b->size < b->max && (size_t)(nl - b->base) < UINT32_MAX;
+}
+
+/*
+ * Split lines with memchr, the current line begins at 'start' and we know there is no
+ * '\n' in [start, p).
+ */
+static char const *
+scan_lines_tail(char const * start, char const * p, char const * end, struct line_batch * b)
+{
+    while (p < end) {
+        char const * nl = memchr(p, '\n', end - p);
+        if (nl == NULL)
+            break;
+
+        bool more = push_line(b, start, nl);
+        start = p = nl + 1;
+        if (!more)
+            return start;
+    }
+
+    /* the last line might not end with '\n' */
+    if (start < end) {
+        push_line(b, start, end);
+        start = end;
+    }
+
+    return start;
+}
+
+#ifdef SCAN_X86
+
+__attribute__((target("sse2"))) static char const *
+scan_lines_sse2(char const * pos, char const * end, struct line_batch * b)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    char const * start = pos;
+    char const * p = pos;
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((__m128i const *)p);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+
+        while (mask) {
+            char const * e = p + __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            bool more = push_line(b, start, e);
+            start = e + 1;
+            if (!more)
+                return start;
+        }
+    }
+
+    return scan_lines_tail(start, p, end, b);
+}
+
+__attribute__((target("avx2"))) static char const *
+scan_lines_avx2(char const * pos, char const * end, struct line_batch * b)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    char const * start = pos;
+    char const * p = pos;
+
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i const *)p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+
+        while (mask) {
+            char const * e = p + __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            bool more = push_line(b, start, e);
+            start = e + 1;
+            if (!more)
+                return start;
+        }
+    }
+
+    return scan_lines_tail(start, p, end, b);
+}
+
+#endif
+
+char const *
+scan_lines(char const * pos, char const * end, unsigned max, struct line_batch * b)
+{
+    b->base = pos;
+    b->size = 0;
+    b->max = max < LINE_BATCH_SIZE ? max : LINE_BATCH_SIZE;
+
+    if (pos >= end)
+        return pos;
+
+#ifdef SCAN_X86
+    if (__builtin_cpu_supports("avx2"))
+        return scan_lines_avx2(pos, end, b);
+    if (__builtin_cpu_supports("sse2"))
+        return scan_lines_sse2(pos, end, b);
+#endif
+
+    return scan_lines_tail(pos, pos, end, b);
+}
+
+char const *
+scan_find_diff_header(char const * pos, char const * end)
+{
+    static const char needle[] = "\n" DIFF_HEADER_PREFIX;
+
+    if (pos >= end)
+        return NULL;
+
+    char const * p = memmem(pos, end - pos, needle, sizeof(needle) - 1);
+    return p ? p + 1 : NULL;
+}
+
+/* Whether the line at 'p' is a diff header */
+static inline bool
+is_diff_header_at(char const * p, char const * end)
+{
+    return end - p >= (ptrdiff_t)DIFF_HEADER_LEN && p[0] == 'd'
+        && memcmp(p, DIFF_HEADER_PREFIX, DIFF_HEADER_LEN) == 0;
+}
+
+/* A diff header starts after a '\n', so every line on the way is counted */
+static char const *
+count_to_diff_header_tail(char const * p, char const * end, size_t * lines)
+{
+    while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+        ++*lines;
+        if (is_diff_header_at(++p, end))
+            return p;
+    }
+
+    return NULL;
+}
+
+#ifdef SCAN_X86
+
+__attribute__((target("sse2"))) static char const *
+count_to_diff_header_sse2(char const * pos, char const * end, size_t * lines)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    char const * p = pos;
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((__m128i const *)p);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+
+        while (mask) {
+            char const * c = p + __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            ++*lines;
+            if (is_diff_header_at(c + 1, end))
+                return c + 1;
+        }
+    }
+
+    return count_to_diff_header_tail(p, end, lines);
+}
+
+__attribute__((target("avx2"))) static char const *
+count_to_diff_header_avx2(char const * pos, char const * end, size_t * lines)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    char const * p = pos;
+
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i const *)p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+
+        while (mask) {
+            char const * c = p + __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            ++*lines;
+            if (is_diff_header_at(c + 1, end))
+                return c + 1;
+        }
+    }
+
+    return count_to_diff_header_tail(p, end, lines);
+}
+
+#endif
+
+char const *
+scan_count_to_diff_header(char const * pos, char const * end, size_t * lines)
+{
+    if (pos >= end)
+        return NULL;
+
+#ifdef SCAN_X86
+    if (__builtin_cpu_supports("avx2"))
+        return count_to_diff_header_avx2(pos, end, lines);
+    if (__builtin_cpu_supports("sse2"))
+        return count_to_diff_header_sse2(pos, end, lines);
+#endif
+
+    return count_to_diff_header_tail(pos, end, lines);
+}
+
+/*
+ * Substring search that compares the first and the last byte of the needle at 16 or 32
+ * positions at once, and only the candidates where both match are compared in full.
+ */
+#ifdef SCAN_X86
+
+__attribute__((target("sse2"))) static char const *
+find_sse2(char const * pos, char const * end, char const * needle, size_t n)
+{
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[n - 1]);
+    char const * p = pos;
+
+    for (; end - p >= (ptrdiff_t)(n - 1 + 16); p += 16) {
+        __m128i a = _mm_loadu_si128((__m128i const *)p);
+        __m128i b = _mm_loadu_si128((__m128i const *)(p + n - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                    _mm_cmpeq_epi8(b, last)));
+
+        while (mask) {
+            char const * c = p + __builtin_ctz(mask);
+            if (memcmp(c + 1, needle + 1, n - 2) == 0)
+                return c;
+            mask &= mask - 1;
+        }
+    }
+
+    return memmem(p, end - p, needle, n);
+}
+
+__attribute__((target("avx2"))) static char const *
+find_avx2(char const * pos, char const * end, char const * needle, size_t n)
+{
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[n - 1]);
+    char const * p = pos;
+
+    for (; end - p >= (ptrdiff_t)(n - 1 + 32); p += 32) {
+        __m256i a = _mm256_loadu_si256((__m256i const *)p);
+        __m256i b = _mm256_loadu_si256((__m256i const *)(p + n - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                    _mm256_cmpeq_epi8(b, last)));
+
+        while (mask) {
+            char const * c = p + __builtin_ctz(mask);
+            if (memcmp(c + 1, needle + 1, n - 2) == 0)
+                return c;
+            mask &= mask - 1;
+        }
+    }
+
+    return memmem(p, end - p, needle, n);
+}
+
+#endif
+
+char const *
+scan_find(char const * pos, char const * end, char const * needle, size_t n)
+{
+    if (n == 0 || pos >= end || (size_t)(end - pos) < n)
+        return NULL;
+
+    if (n == 1)
+        return memchr(pos, needle[0], end - pos);
+
+#ifdef SCAN_X86
+    if (__builtin_cpu_supports("avx2"))
+        return find_avx2(pos, end, needle, n);
+    if (__builtin_cpu_supports("sse2"))
+        return find_sse2(pos, end, needle, n);
+#endif
+
+    return memmem(pos, end - pos, needle, n);
+}
+
+static size_t
+common_prefix_tail(char const * a, char const * b, size_t i, size_t n)
+{
+    while (i < n && a[i] == b[i])
+        ++i;
+
+    return i;
+}
+
+static size_t
+common_suffix_tail(char const * a_end, char const * b_end, size_t i, size_t n)
+{
+    while (i < n && a_end[-1 - (ptrdiff_t)i] == b_end[-1 - (ptrdiff_t)i])
+        ++i;
+
+    return i;
+}
+
+#ifdef SCAN_X86
+
+__attribute__((target("sse2"))) static size_t
+common_prefix_sse2(char const * a, char const * b, size_t n)
+{
+    size_t i = 0;
+    for (; n - i >= 16; i += 16) {
+        __m128i va = _mm_loadu_si128((__m128i const *)(a + i));
+        __m128i vb = _mm_loadu_si128((__m128i const *)(b + i));
+        unsigned diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xffff;
+        if (diff)
+            return i + __builtin_ctz(diff);
+    }
+
+    return common_prefix_tail(a, b, i, n);
+}
+
+__attribute__((target("sse2"))) static size_t
+common_suffix_sse2(char const * a_end, char const * b_end, size_t n)
+{
+    size_t i = 0;
+    for (; n - i >= 16; i += 16) {
+        __m128i va = _mm_loadu_si128((__m128i const *)(a_end - i - 16));
+        __m128i vb = _mm_loadu_si128((__m128i const *)(b_end - i - 16));
+        unsigned diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xffff;
+        if (diff)
+            return i + __builtin_clz(diff) - 16;
+    }
+
+    return common_suffix_tail(a_end, b_end, i, n);
+}
+
+#endif
+
+size_t
+scan_common_prefix(char const * a, char const * b, size_t n)
+{
+#ifdef SCAN_X86
+    if (__builtin_cpu_supports("sse2"))
+        return common_prefix_sse2(a, b, n);
+#endif
+
+    return common_prefix_tail(a, b, 0, n);
+}
+
+size_t
+scan_common_suffix(char const * a_end, char const * b_end, size_t n)
+{
+#ifdef SCAN_X86
+    if (__builtin_cpu_supports("sse2"))
+        return common_suffix_sse2(a_end, b_end, n);
+#endif
+
+    return common_suffix_tail(a_end, b_end, 0, n);
+}
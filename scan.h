@@ -0,0 +1,84 @@
+#ifndef _NADIFF_SCAN_H_
+#define _NADIFF_SCAN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* What a line in a git diff starts with. Decided once when the line is split off. */
+enum line_kind {
+    LINE_KIND_OTHER,
+    LINE_KIND_DIFF_HEADER,      /* diff --git */
+    LINE_KIND_HUNK_HEADER,      /* @@ */
+    LINE_KIND_PRE,              /* - */
+    LINE_KIND_POST,             /* + */
+    LINE_KIND_NEUTRAL,          /* ' ' */
+    LINE_KIND_OLD_MODE,
+    LINE_KIND_NEW_MODE,
+    LINE_KIND_DELETED,
+    LINE_KIND_NEW_FILE,
+    LINE_KIND_COPY_FROM,
+    LINE_KIND_COPY_TO,
+    LINE_KIND_RENAME_FROM,
+    LINE_KIND_RENAME_TO,
+    LINE_KIND_SIMILARITY,
+    LINE_KIND_DISSIMILARITY,
+    LINE_KIND_INDEX,
+    LINE_KIND_BINARY,
+};
+
+#define LINE_BATCH_SIZE 4096
+
+#define DIFF_HEADER_PREFIX "diff --git "
+#define DIFF_HEADER_LEN (sizeof(DIFF_HEADER_PREFIX) - 1)
+
+/*
+ * A batch of lines split off from a buffer. Offsets are relative to 'base' and lengths
+ * exclude the '\n'.
+ */
+struct line_batch {
+    char const * base;
+    unsigned size;
+    unsigned max; /* lines to split off at most, up to LINE_BATCH_SIZE */
+    uint32_t start[LINE_BATCH_SIZE];
+    uint32_t len[LINE_BATCH_SIZE];
+    uint8_t kind[LINE_BATCH_SIZE];
+};
+
+/*
+ * Split up to 'max' lines, at most LINE_BATCH_SIZE, off [pos, end) and classify them. The
+ * last line does not need to end with '\n'. Returns the position after the last line in the
+ * batch.
+ */
+char const *
+scan_lines(char const * pos, char const * end, unsigned max, struct line_batch * b);
+
+enum line_kind
+classify_line(char const * data, unsigned len);
+
+/*
+ * Find the first diff header that starts a line after 'pos'. Returns the start of that
+ * line, or NULL if there is none in [pos, end).
+ */
+char const *
+scan_find_diff_header(char const * pos, char const * end);
+
+/*
+ * Like scan_find_diff_header(), and add the number of '\n' in [pos, the header) to '*lines',
+ * or of [pos, end) if there is no header.
+ */
+char const *
+scan_count_to_diff_header(char const * pos, char const * end, size_t * lines);
+
+/* The first occurrence of 'needle' in [pos, end), or NULL if there is none */
+char const *
+scan_find(char const * pos, char const * end, char const * needle, size_t n);
+
+/* The number of bytes that the first 'n' bytes of 'a' and 'b' have in common at the start */
+size_t
+scan_common_prefix(char const * a, char const * b, size_t n);
+
+/* The number of bytes that the 'n' bytes before 'a_end' and 'b_end' have in common at the end */
+size_t
+scan_common_suffix(char const * a_end, char const * b_end, size_t n);
+
+#endif
@@ -0,0 +1,342 @@
+#define _GNU_SOURCE /* memrchr() */
+#include "search.h"
+
+#include "compare.h"
+#include "error.h"
+#include "scan.h"
+
+#include <limits.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SEARCH_MAX_THREADS 8
+#define NO_DIFF UINT_MAX
+
+/* where the hits of a diff are in 'hits', 'first' is NOT_SEARCHED until it is searched */
+#define NOT_SEARCHED UINT32_MAX
+
+struct search_result {
+    uint32_t first;
+    uint32_t count;
+};
+
+struct search_result_array {
+    ARRAY_FIELDS(struct search_result);
+};
+
+struct line_buffer {
+    ARRAY_FIELDS(char);
+};
+
+ARRAY_FUNCTIONS(search_result_array, struct search_result)
+ARRAY_FUNCTIONS(line_buffer, char)
+
+struct search_worker {
+    pthread_t thread;
+    regex_t re;
+
+    /* the hits of the diff being searched, and a '\0' terminated line for regexec() */
+    struct uint_array hits;
+    struct line_buffer line;
+};
+
+static struct search_worker workers[SEARCH_MAX_THREADS];
+static unsigned num_workers = 0;
+static unsigned num_regex = 0;
+
+/*
+ * What follows is shared by the workers and protected by the stream lock. Diffs are picked
+ * from 'first_diff' on, and once those are taken from 0 up to 'first_diff'.
+ */
+static struct diff_stream * stream = NULL;
+static bool stop = false;
+static unsigned first_diff = 0;
+static unsigned next_high = 0;
+static unsigned next_low = 0;
+
+static struct search_result_array results;
+static struct uint_array hits;
+static unsigned num_hits = 0;
+static unsigned num_searched = 0;
+
+/* set before the workers start and not changed until they are stopped */
+static enum search_kind kind = SEARCH_LITERAL;
+static char * needle = NULL;
+static size_t needle_len = 0;
+
+/* NOTE: Must be called with the stream lock held */
+static unsigned
+pick_diff(void)
+{
+    if (next_high < stream->da.size)
+        return next_high++;
+    if (next_low < first_diff)
+        return next_low++;
+
+    return NO_DIFF;
+}
+
+static bool
+is_hunk_line(char c)
+{
+    return c == '+' || c == '-' || c == ' ';
+}
+
+static bool
+add_hit(struct search_worker * w, char const * data, char const * line)
+{
+    if (!uint_array_reserve(&w->hits, 1))
+        return false;
+
+    /* the hunk line array leaves out the '+', '-' or ' ' in front */
+    w->hits.data[w->hits.size++] = line + 1 - data;
+    return true;
+}
+
+/* Look for the whole of the hunk data at once, and find the line of each hit afterwards */
+static bool
+search_literal(struct search_worker * w, char const * data, size_t size)
+{
+    char const * end = data + size;
+    char const * p = data;
+    char const * hit;
+
+    while ((hit = scan_find(p, end, needle, needle_len)) != NULL) {
+        char const * nl = memrchr(data, '\n', hit - data);
+        char const * line = nl != NULL ? nl + 1 : data;
+
+        /* the hit starts with the '+', '-' or ' ' in front of the line */
+        if (hit == line) {
+            p = hit + 1;
+            continue;
+        }
+
+        if (is_hunk_line(*line))
+            try_ret(add_hit(w, data, line));
+
+        /* one hit per line */
+        char const * line_end = memchr(hit, '\n', end - hit);
+        p = line_end != NULL ? line_end + 1 : end;
+    }
+
+    return true;
+}
+
+static bool
+search_regex(struct search_worker * w, char const * data, size_t size)
+{
+    char const * end = data + size;
+
+    for (char const * line = data; line < end;) {
+        char const * nl = memchr(line, '\n', end - line);
+        char const * line_end = nl != NULL ? nl : end;
+        size_t len = line_end - line;
+
+        if (len > 1 && is_hunk_line(*line)) {
+            w->line.size = 0;
+            if (len > UINT_MAX || !line_buffer_reserve(&w->line, len))
+                return false;
+
+            memcpy(w->line.data, line + 1, len - 1);
+            w->line.data[len - 1] = '\0';
+
+            if (regexec(&w->re, w->line.data, 0, NULL, 0) == 0)
+                try_ret(add_hit(w, data, line));
+        }
+
+        line = nl != NULL ? nl + 1 : end;
+    }
+
+    return true;
+}
+
+/* NOTE: Must be called with the stream lock held */
+static bool
+publish_hits(struct search_worker * w, unsigned i)
+{
+    if (results.size <= i) {
+        if (!search_result_array_reserve(&results, i + 1 - results.size))
+            return false;
+
+        while (results.size <= i)
+            results.data[results.size++] = (struct search_result) { .first = NOT_SEARCHED };
+    }
+
+    if (!uint_array_reserve(&hits, w->hits.size))
+        return false;
+
+    memcpy(hits.data + hits.size, w->hits.data, w->hits.size * sizeof(unsigned));
+    results.data[i] = (struct search_result) { .first = hits.size, .count = w->hits.size };
+    hits.size += w->hits.size;
+
+    num_hits += w->hits.size;
+    num_searched++;
+
+    return true;
+}
+
+static void *
+search_thread(void * arg)
+{
+    struct search_worker * w = arg;
+    struct diff_stream * ds = stream;
+
+    pthread_mutex_lock(&ds->lock);
+
+    while (!stop) {
+        unsigned i = pick_diff();
+        if (i == NO_DIFF) {
+            if (ds->is_done)
+                break;
+
+            /* wait for the parser to deliver more diffs */
+            pthread_cond_wait(&ds->cond, &ds->lock);
+            continue;
+        }
+
+        /* the hunk data stays where it is, even if the diff array is reallocated */
+        char const * data = ds->da.data[i].hunk_data;
+        size_t size = ds->da.data[i].hunk_size;
+
+        pthread_mutex_unlock(&ds->lock);
+
+        /* the lines are offsets that fit in 32 bits, larger diffs can't be shown anyway */
+        w->hits.size = 0;
+        bool ok = true;
+        if (data != NULL && size <= UINT32_MAX) {
+            if (kind == SEARCH_REGEX)
+                ok = search_regex(w, data, size);
+            else
+                ok = search_literal(w, data, size);
+        }
+
+        pthread_mutex_lock(&ds->lock);
+
+        /* out of memory, keep what was found so far */
+        if (!ok || !publish_hits(w, i))
+            stop = true;
+
+        parse_stdin_notify(ds);
+    }
+
+    pthread_mutex_unlock(&ds->lock);
+    return NULL;
+}
+
+bool
+search_start(struct diff_stream * ds, char const * pattern, enum search_kind k,
+    unsigned first, char * error, size_t error_size)
+{
+    search_stop();
+
+    needle_len = strlen(pattern);
+    if (needle_len == 0) {
+        snprintf(error, error_size, "Nothing to search for");
+        return false;
+    }
+
+    needle = strdup(pattern);
+    if (needle == NULL) {
+        snprintf(error, error_size, "Failed to allocate search pattern");
+        return false;
+    }
+
+    kind = k;
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned n = cores < 1 ? 1 : MIN((unsigned long)cores, SEARCH_MAX_THREADS);
+
+    /* regexec() locks the pattern it is given, so every worker gets one of its own */
+    if (kind == SEARCH_REGEX) {
+        for (; num_regex < n; ++num_regex) {
+            int ret = regcomp(&workers[num_regex].re, needle, REG_EXTENDED | REG_NOSUB);
+            if (ret != 0) {
+                regerror(ret, &workers[num_regex].re, error, error_size);
+                search_stop();
+                return false;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&ds->lock);
+    stream = ds;
+    stop = false;
+    first_diff = first;
+    next_high = first;
+    next_low = 0;
+    pthread_mutex_unlock(&ds->lock);
+
+    for (; num_workers < n; ++num_workers) {
+        if (pthread_create(&workers[num_workers].thread, NULL, search_thread,
+                    &workers[num_workers]) != 0)
+            break;
+    }
+
+    if (num_workers == 0) {
+        snprintf(error, error_size, "Failed to start search thread");
+        search_stop();
+        return false;
+    }
+
+    return true;
+}
+
+void
+search_stop(void)
+{
+    if (stream != NULL) {
+        pthread_mutex_lock(&stream->lock);
+        stop = true;
+        pthread_cond_broadcast(&stream->cond);
+        pthread_mutex_unlock(&stream->lock);
+    }
+
+    for (unsigned i = 0; i < num_workers; ++i)
+        pthread_join(workers[i].thread, NULL);
+    num_workers = 0;
+
+    for (unsigned i = 0; i < num_regex; ++i)
+        regfree(&workers[i].re);
+    num_regex = 0;
+
+    for (unsigned i = 0; i < SEARCH_MAX_THREADS; ++i) {
+        uint_array_release(&workers[i].hits);
+        line_buffer_release(&workers[i].line);
+    }
+
+    /* nobody else looks at the hits once the workers are gone */
+    search_result_array_release(&results);
+    uint_array_release(&hits);
+    num_hits = 0;
+    num_searched = 0;
+
+    free(needle);
+    needle = NULL;
+    stream = NULL;
+}
+
+bool
+search_get_hits(unsigned i, unsigned const ** h, unsigned * count)
+{
+    if (i >= results.size || results.data[i].first == NOT_SEARCHED)
+        return false;
+
+    *h = hits.data + results.data[i].first;
+    *count = results.data[i].count;
+    return true;
+}
+
+unsigned
+search_num_hits(void)
+{
+    return num_hits;
+}
+
+bool
+search_is_done(void)
+{
+    return stream == NULL || stop || (stream->is_done && num_searched == stream->da.size);
+}
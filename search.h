@@ -0,0 +1,46 @@
+#ifndef _NADIFF_SEARCH_H_
+#define _NADIFF_SEARCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "parse.h"
+
+enum search_kind {
+    SEARCH_LITERAL,
+    SEARCH_REGEX, /* POSIX extended */
+};
+
+/*
+ * Search the hunk lines of all diffs of the stream on a pool of threads, from diff 'first'
+ * on and then the ones before it. Diffs that are delivered while searching are searched
+ * too. The hits of a diff are there to be looked at as soon as it is searched. A search
+ * that is already running is stopped. Returns false and a message in 'error' if the search
+ * could not be started.
+ * NOTE: Must be called without the stream lock held
+ */
+bool
+search_start(struct diff_stream * ds, char const * pattern, enum search_kind kind,
+    unsigned first, char * error, size_t error_size);
+
+/* Stop searching and forget the hits. NOTE: Must be called without the stream lock held */
+void
+search_stop(void);
+
+/*
+ * The rest must be called with the stream lock held.
+ *
+ * Returns false if diff 'i' is not searched yet. Otherwise '*hits' are the offsets of its
+ * matching lines from its hunk data, the same offsets as in its hunk line array, in order.
+ */
+bool
+search_get_hits(unsigned i, unsigned const ** hits, unsigned * count);
+
+/* The hits found so far */
+unsigned
+search_num_hits(void);
+
+/* Whether every diff of the stream is searched and the stream is done */
+bool
+search_is_done(void);
+
+#endif
@@ -0,0 +1,115 @@
+#include "stat.h"
+
+#include "error.h"
+#include "parse.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* by enum diff_status */
+static char const * const status_letters[] = { "M", "A", "D", "R", "C" };
+static char const * const status_names[] = { "modified", "added", "deleted", "renamed", "copied" };
+
+static enum stat_format format = STAT_TEXT;
+
+/* a reader at the other end of a pipe gets every record right away */
+static bool flush_each = false;
+
+/* A name of the diff header without the a/ or b/ that git puts in front of the path */
+static char const *
+path_of(char const * name, char prefix)
+{
+    if (name[0] == prefix && name[1] == '/')
+        return name + 2;
+
+    return name;
+}
+
+static bool
+has_old_path(struct diff const * d)
+{
+    return d->status == DIFF_STATUS_RENAMED || d->status == DIFF_STATUS_COPIED;
+}
+
+static void
+print_text(struct diff const * d, struct hunk_counts const * c)
+{
+    printf("%llu\t%llu\t%llu\t%s\t", c->post_lines, c->pre_lines, c->hunks,
+        status_letters[d->status]);
+
+    if (has_old_path(d))
+        printf("%s\t", path_of(d->pre_img_name, 'a'));
+
+    printf("%s\n", path_of(d->post_img_name, 'b'));
+}
+
+/* Quotes, backslashes and control characters are escaped, anything else is kept as is */
+static void
+print_json_string(char const * s)
+{
+    putchar('"');
+
+    for (; *s != '\0'; ++s) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            putchar('\\');
+            putchar(c);
+        } else if (c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+
+    putchar('"');
+}
+
+static void
+print_json(struct diff const * d, struct hunk_counts const * c)
+{
+    printf("{\"path\":");
+    print_json_string(path_of(d->post_img_name, 'b'));
+
+    if (has_old_path(d)) {
+        printf(",\"old_path\":");
+        print_json_string(path_of(d->pre_img_name, 'a'));
+    }
+
+    printf(",\"status\":\"%s\",\"added\":%llu,\"removed\":%llu,\"hunks\":%llu}\n",
+        status_names[d->status], c->post_lines, c->pre_lines, c->hunks);
+}
+
+static bool
+print_diff_stat(void * ctx, struct diff const * d)
+{
+    (void)ctx;
+
+    /* broken hunks stop it, like they stop the other modes */
+    struct hunk_counts c;
+    try_ret(count_diff_hunks(d, &c));
+
+    if (format == STAT_JSON)
+        print_json(d, &c);
+    else
+        print_text(d, &c);
+
+    if (flush_each)
+        fflush(stdout);
+
+    return true;
+}
+
+bool
+stat_print(enum stat_format f)
+{
+    format = f;
+
+    struct stat st;
+    flush_each = fstat(STDOUT_FILENO, &st) != 0 || !S_ISREG(st.st_mode);
+
+    bool ok = parse_stdin_each(print_diff_stat, NULL);
+    fflush(stdout);
+
+    return ok;
+}
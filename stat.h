@@ -0,0 +1,19 @@
+#ifndef _NADIFF_STAT_H_
+#define _NADIFF_STAT_H_
+
+#include <stdbool.h>
+
+enum stat_format {
+    STAT_TEXT, /* tab separated fields, a line per diff */
+    STAT_JSON, /* a JSON object per line */
+};
+
+/*
+ * Read the diffs from stdin and print a record of each to stdout as soon as it is read:
+ * its added and removed lines, its hunks, its status and its paths. Nothing of a diff is
+ * kept once it is printed, so memory doesn't grow with the input.
+ */
+bool
+stat_print(enum stat_format format);
+
+#endif
@@ -2,31 +2,24 @@
 #define _NADIFF_TYPES_H_
 
 #include <stdbool.h>
-
-// TODO create macro of arrays and alloc functions
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+#include "array.h"
 
 struct uint_array {
-    unsigned * data;
-    unsigned size;
-    unsigned cap;
+    ARRAY_FIELDS(unsigned);
 };
 
 struct diff_array {
-    struct diff * data;
-    unsigned size;
-    unsigned cap;
-};
+    ARRAY_FIELDS(struct diff);
 
-struct hunk_array {
-    struct hunk * data;
-    unsigned size;
-    unsigned cap;
+    /* owns the names and section names of all diffs */
+    struct arena text;
 };
 
-struct hunk_line_array {
-    struct hunk_line * data;
-    unsigned size;
-    unsigned cap;
+struct hunk_array {
+    ARRAY_FIELDS(struct hunk);
 };
 
 enum hunk_line_type {
@@ -35,34 +28,71 @@ enum hunk_line_type {
     NEUTRAL_LINE,
 };
 
-struct hunk_line {
-    char * line;
-    unsigned len;
-    enum hunk_line_type type;
+/*
+ * The lines of all hunks of a diff as parallel arrays. A line is an offset from the hunk
+ * data of its diff and a length with the line type packed into the low bits. When 'cap' is
+ * 0 the arrays are not ours, they point into the mapped cache.
+ */
+struct hunk_line_array {
+    uint32_t * offset;
+    uint32_t * len_type;
+    unsigned size;
+    unsigned cap;
 };
 
+#define HUNK_LINE_TYPE_BITS 2
+#define HUNK_LINE_TYPE_MASK ((1u << HUNK_LINE_TYPE_BITS) - 1)
+#define HUNK_LINE_MAX_LEN (UINT32_MAX >> HUNK_LINE_TYPE_BITS)
+
+static inline uint32_t
+hunk_line_pack(unsigned len, enum hunk_line_type type)
+{
+    return len << HUNK_LINE_TYPE_BITS | type;
+}
+
+static inline unsigned
+hunk_line_len(struct hunk_line_array const * a, unsigned i)
+{
+    return a->len_type[i] >> HUNK_LINE_TYPE_BITS;
+}
+
+static inline enum hunk_line_type
+hunk_line_type(struct hunk_line_array const * a, unsigned i)
+{
+    return a->len_type[i] & HUNK_LINE_TYPE_MASK;
+}
+
 struct hunk {
     unsigned pre_line_nr;
     unsigned post_line_nr;
     unsigned pre_num_lines;
     unsigned post_num_lines;
 
-    char * section_name;
+    /* points into the input buffer, not '\0' terminated */
+    char const * section_name;
+    unsigned section_name_len;
 
-    struct hunk_line_array hla;
+    /* the lines of this hunk in the hunk line array of its diff */
+    unsigned first_line;
+    unsigned num_lines;
 };
 
 /*
- * Does this diff represent a new, deleted or changed file?
+ * Does this diff represent a new, deleted, renamed, copied or changed file?
  */
 enum diff_status {
     DIFF_STATUS_CHANGED,
     DIFF_STATUS_NEW,
-    DIFF_STATUS_DELETED
+    DIFF_STATUS_DELETED,
+    DIFF_STATUS_RENAMED,
+    DIFF_STATUS_COPIED,
 };
 
+struct cache_diff;
+
 struct diff {
     struct hunk_array ha;
+    struct hunk_line_array hla;
     char const * pre_img_name;
     char const * post_img_name;
 
@@ -74,9 +104,18 @@ struct diff {
 
     /* some diffs contain only renames or mode changes */
     bool expect_line_changes;
+
+    /* The hunks are parsed from this range of the input when they are first needed */
+    bool is_parsed;
+    char const * hunk_data;
+    size_t hunk_size;
+
+    /* set if the hunks are read from the on-disk cache instead */
+    struct cache_diff const * cached;
 };
 
 
+/* What one side of a row shows */
 enum render_line_type {
     RENDER_LINE_PRE,
     RENDER_LINE_POST,
@@ -87,34 +126,163 @@ enum render_line_type {
     RENDER_LINE_SPACE,
 };
 
-struct render_line {
-    enum render_line_type type;
-    char * data; /* probably just pointing to data inside a hunk_line */
-    unsigned len;
-    unsigned line_nr;
+enum render_row_type {
+    RENDER_ROW_SPACE,
+    RENDER_ROW_SECTION_NAME,
+    RENDER_ROW_NORMAL,
+    RENDER_ROW_CHANGE,
 };
 
-struct render_line_array {
-    struct render_line * data;
+/*
+ * The laid out rows of a diff as parallel arrays. A row has a line on each side, as an
+ * index in the hunk line array: the same line on both sides of a normal row, and
+ * NO_RENDER_LINE on the padded side of a change. A section name row has the index of its
+ * hunk instead. The row type is packed with RENDER_ROW_COLUMNS() of the sides whose line
+ * doesn't take a column per byte, those with tabs or multibyte characters.
+ */
+struct render_row_array {
+    uint32_t * line[2];
+    uint32_t * flags;
     unsigned size;
     unsigned cap;
 };
 
+#define NO_RENDER_LINE UINT32_MAX
+#define RENDER_ROW_TYPE_MASK 0x3u
+#define RENDER_ROW_COLUMNS(side) (0x4u << (side))
+
+static inline enum render_row_type
+render_row_type(struct render_row_array const * a, unsigned i)
+{
+    return a->flags[i] & RENDER_ROW_TYPE_MASK;
+}
+
+static inline enum render_line_type
+render_row_line_type(struct render_row_array const * a, unsigned i, unsigned side)
+{
+    switch (render_row_type(a, i)) {
+    case RENDER_ROW_SPACE:
+        return RENDER_LINE_SPACE;
+    case RENDER_ROW_SECTION_NAME:
+        return RENDER_LINE_SECTION_NAME;
+    case RENDER_ROW_NORMAL:
+        return RENDER_LINE_NORMAL;
+    default:
+        if (a->line[side][i] == NO_RENDER_LINE)
+            return side == 0 ? RENDER_LINE_PRE_LINE : RENDER_LINE_POST_LINE;
+        return side == 0 ? RENDER_LINE_PRE : RENDER_LINE_POST;
+    }
+}
+
+/*
+ * Long lines with RENDER_ROW_COLUMNS() have 'count' entries in the column bytes of their
+ * render line pair, from 'first' on. Entry k is where the character that covers column
+ * (k + 1) * COLUMN_STEP starts, as its byte in the line and its column, so drawing from
+ * some column on does not have to walk the whole line.
+ */
+#define COLUMN_STEP 64
+
+struct column_index {
+    uint32_t offset; /* the offset of the line */
+    uint32_t first;
+    uint32_t count;
+};
+
+struct column_index_array {
+    ARRAY_FIELDS(struct column_index);
+};
+
+/*
+ * What changed within a pre line and the post line beside it, found the first time the two
+ * are shown. The 'count0' ranges of the pre line start at 'first' in the highlight bytes
+ * and the 'count1' ranges of the post line follow, two entries per range: where it starts and
+ * ends in the line.
+ */
+#define HIGHLIGHT_NOT_DONE UINT32_MAX
+
+struct line_highlight {
+    uint32_t first;
+    uint16_t count0;
+    uint16_t count1;
+};
+
+struct line_highlight_array {
+    ARRAY_FIELDS(struct line_highlight);
+};
+
+/*
+ * The rows of a diff come in blocks that are laid out alike: the padding and the section
+ * name before a hunk, lines that are on both sides, and changes. A change has its pre lines
+ * on the left and its post lines on the right, the post lines following the pre lines in the hunk line
+ * array, and the shorter side is padded. Blocks have at least one row and are sorted by
+ * row, so any row is found without laying out the rows before it.
+ */
+enum row_block_type {
+    ROW_BLOCK_SECTION,
+    ROW_BLOCK_NORMAL,
+    ROW_BLOCK_CHANGE,
+};
+
+struct row_block {
+    uint32_t type;
+    uint32_t row; /* the first row */
+    uint32_t hunk;
+    uint32_t first_line; /* in the hunk line array, the first line of the hunk for a section */
+    uint32_t pre_line_nr;
+    uint32_t post_line_nr;
+
+    /* the lines of a normal block are both, a section block has 'num_pre' rows */
+    uint32_t num_pre;
+    uint32_t num_post;
+};
+
+struct row_block_array {
+    ARRAY_FIELDS(struct row_block);
+};
+
+/*
+ * The rows of a diff, and the render lines of the rows from 'first_row' on, which are laid
+ * out for a window around the shown rows when they are drawn.
+ */
 struct render_line_pair {
+    /* the rows are indexed */
     bool is_populated;
-    struct render_line_array a0;
-    struct render_line_array a1;
 
-    /* the lines with the biggest length in a0 and a1 */
-    unsigned max_len_a0;
-    unsigned max_len_a1;
+    /* laying it out in the background failed, the render loop does it and tells why */
+    bool skip_precompute;
+
+    struct row_block_array blocks;
+    unsigned num_rows;
+
+    unsigned first_row;
+    struct render_row_array rows;
+
+    /* sorted by offset, with two column bytes per entry: the byte and the column */
+    struct column_index_array col_index;
+    struct uint_array col_bytes;
+
+    /*
+     * One per laid out row once a row of changed lines has been shown, see struct
+     * line_highlight
+     */
+    struct line_highlight_array highlights;
+    struct uint_array highlight_bytes;
+
+    /* the widest laid out lines of each side, in columns */
+    unsigned max_len[2];
 };
 
 struct render_line_pair_array {
-    struct render_line_pair * data;
-    unsigned size;
-    unsigned cap;
+    ARRAY_FIELDS(struct render_line_pair);
 };
 
+ARRAY_FUNCTIONS(uint_array, unsigned)
+ARRAY_FUNCTIONS(diff_array, struct diff)
+ARRAY_FUNCTIONS(hunk_array, struct hunk)
+ARRAY_FUNCTIONS(column_index_array, struct column_index)
+ARRAY_FUNCTIONS(line_highlight_array, struct line_highlight)
+ARRAY_FUNCTIONS(row_block_array, struct row_block)
+ARRAY_FUNCTIONS(render_line_pair_array, struct render_line_pair)
+
 
 #endif
@@ -1,17 +1,266 @@
 #include "vt100.h"
 #include "error.h"
 #include "compare.h"
+#include "array.h"
+#include "na_string.h"
 
 #include <termios.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/ioctl.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
 struct termios org;
 
+/*
+ * Everything we draw is collected here and written to the terminal in one go when the
+ * frame is done. A write per escape sequence costs thousands of syscalls per frame and
+ * the terminal shows the frame half drawn in between.
+ */
+struct out_buffer {
+    ARRAY_FIELDS(char);
+};
+
+ARRAY_FUNCTIONS(out_buffer, char)
+
+static struct out_buffer out;
+
+/* how much of 'out' the terminal has taken so far */
+static size_t out_sent = 0;
+
+/*
+ * The flags of stdout from before it was made non-blocking. The file description is shared
+ * with the shell, so they are put back on exit and on the signals that end nadiff too.
+ */
+static volatile sig_atomic_t org_out_flags = -1;
+
+static const int fatal_signals[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGABRT, SIGSEGV, SIGBUS };
+#define NUM_FATAL_SIGNALS (sizeof(fatal_signals) / sizeof(fatal_signals[0]))
+static struct sigaction org_signal_actions[NUM_FATAL_SIGNALS];
+static bool signal_caught[NUM_FATAL_SIGNALS];
+
+/* bytes and writes since the last frame ended */
+static size_t pending_bytes = 0;
+static unsigned pending_writes = 0;
+
+static struct vt100_frame_stats stats;
+
+/*
+ * Write as much as the terminal takes, or all of it if 'wait' is set. Returns how much is
+ * done with, which includes what is dropped because the terminal is broken.
+ */
+static size_t
+write_out(char const * data, size_t len, bool wait)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t ret = write(STDOUT_FILENO, data + done, len - done);
+        pending_writes++;
+
+        if (ret >= 0) {
+            done += ret;
+        } else if (errno == EAGAIN && wait) {
+            struct pollfd p = { .fd = STDOUT_FILENO, .events = POLLOUT };
+            poll(&p, 1, -1);
+        } else if (errno == EAGAIN) {
+            break;
+        } else if (errno != EINTR) {
+            /* nothing sensible to do about a broken terminal, drop the rest */
+            return len;
+        }
+    }
+
+    return done;
+}
+
+static void
+send_out(bool wait)
+{
+    out_sent += write_out(out.data + out_sent, out.size - out_sent, wait);
+    if (out_sent == out.size)
+        out.size = out_sent = 0;
+}
+
+static void
+out_append(char const * data, size_t len)
+{
+    pending_bytes += len;
+
+    if (len > UINT_MAX || !out_buffer_reserve(&out, len)) {
+        /* without room in the buffer we write directly, slow but still correct */
+        vt100_flush();
+        write_out(data, len, true);
+        return;
+    }
+
+    memcpy(out.data + out.size, data, len);
+    out.size += len;
+}
+
+#define out_append_str(s) out_append(s, sizeof(s) - 1)
+
+/* Character attributes of a cell */
+#define ATTR_FG_MASK   0x03
+#define ATTR_FG_RED    0x01
+#define ATTR_FG_GREEN  0x02
+#define ATTR_FG_YELLOW 0x03
+#define ATTR_BG_MASK   0x0c
+#define ATTR_BG_RED    0x04
+#define ATTR_BG_GREEN  0x08
+#define ATTR_REVERSE   0x10
+#define ATTR_UNDERLINE 0x20
+
+/* One character on the screen. 'ch' holds a single UTF-8 sequence, not terminated. */
+struct cell {
+    char ch[4];
+    uint8_t len;
+    uint8_t attr;
+};
+
+/*
+ * Between vt100_begin_frame() and vt100_end_frame() nothing is sent to the terminal, the
+ * frame is drawn into 'back' instead. Ending the frame sends only the cells that differ
+ * from 'front', which is what the terminal shows.
+ */
+static struct cell * front = NULL;
+static struct cell * back = NULL;
+static int grid_cols = 0;
+static int grid_rows = 0;
+static bool front_valid = false;
+static bool in_frame = false;
+
+/* rows that the frame expects to have moved since the last one, see vt100_scroll_rows() */
+static int scroll_top = 0;
+static int scroll_bottom = 0;
+static int scroll_lines = 0;
+
+/* where the next character of the frame goes, 1-based like the terminal, and how it looks */
+static int draw_x = 1;
+static int draw_y = 1;
+static uint8_t draw_attr = 0;
+
+static const struct cell blank_cell = { .ch = " ", .len = 1, .attr = 0 };
+
+static void
+clear_cells(struct cell * cells)
+{
+    for (size_t i = 0, n = (size_t)grid_cols * grid_rows; i < n; ++i)
+        cells[i] = blank_cell;
+}
+
+static void
+change_attr(uint8_t keep, uint8_t add, char const * seq, size_t len)
+{
+    if (in_frame)
+        draw_attr = (draw_attr & keep) | add;
+    else
+        out_append(seq, len);
+}
+
+#define change_attr_str(keep, add, s) change_attr(keep, add, s, sizeof(s) - 1)
+
+/*
+ * Put text into the frame, one character per cell. Text outside the screen is clipped.
+ * Control characters would move the cursor of the terminal behind our back, so they are
+ * left out, and bytes that are not valid UTF-8 are shown as '?'.
+ */
+static void
+draw_text(char const * data, size_t len)
+{
+    char const * p = data;
+    char const * end = p + len;
+
+    /* the cells of the row that is drawn on, NULL if it is off the screen */
+    struct cell * row = NULL;
+    if (draw_y >= 1 && draw_y <= grid_rows)
+        row = &back[(size_t)(draw_y - 1) * grid_cols];
+
+    while (p < end) {
+        struct cell c = { .ch = { *p }, .len = 1, .attr = draw_attr };
+        unsigned n = 1;
+
+        /* most of what is drawn is printable ASCII, which takes one byte */
+        if ((unsigned char)*p >= 0x80) {
+            n = utf8_len(p, end);
+            if (n == 0) {
+                c.ch[0] = '?';
+                n = 1;
+            } else {
+                memcpy(c.ch, p, n);
+                c.len = n;
+            }
+        } else if (is_control_char(*p)) {
+            p++;
+            continue;
+        }
+        p += n;
+
+        if (row != NULL && draw_x >= 1 && draw_x <= grid_cols)
+            row[draw_x - 1] = c;
+        draw_x++;
+    }
+}
+
+/*
+ * Switch the terminal from one set of attributes to another with a single SGR sequence. A
+ * VT100 can only turn attributes off all at once, so that is what we do when any of them
+ * goes away.
+ */
+static void
+emit_attr(uint8_t from, uint8_t to)
+{
+    if (from == to)
+        return;
+
+    char seq[32] = "\x1b[";
+    size_t len = 2;
+
+    if ((from & ~to & (ATTR_REVERSE | ATTR_UNDERLINE)) ||
+        ((from & ATTR_FG_MASK) && !(to & ATTR_FG_MASK)) ||
+        ((from & ATTR_BG_MASK) && !(to & ATTR_BG_MASK))) {
+        seq[len++] = '0';
+        from = 0;
+    }
+
+    static char const * const fg[] = { NULL, "31", "32", "33" };
+    static char const * const bg[] = { NULL, "41", "42", NULL };
+    char const * params[4];
+    unsigned num_params = 0;
+
+    if ((to & ATTR_REVERSE) && !(from & ATTR_REVERSE))
+        params[num_params++] = "7";
+    if ((to & ATTR_UNDERLINE) && !(from & ATTR_UNDERLINE))
+        params[num_params++] = "4";
+    if ((to & ATTR_FG_MASK) != (from & ATTR_FG_MASK))
+        params[num_params++] = fg[to & ATTR_FG_MASK];
+    if ((to & ATTR_BG_MASK) != (from & ATTR_BG_MASK))
+        params[num_params++] = bg[(to & ATTR_BG_MASK) >> 2];
+
+    for (unsigned i = 0; i < num_params; ++i) {
+        if (len > 2)
+            seq[len++] = ';';
+        size_t n = strlen(params[i]);
+        memcpy(seq + len, params[i], n);
+        len += n;
+    }
+    seq[len++] = 'm';
+
+    out_append(seq, len);
+}
+
+static bool
+cell_equal(struct cell const * a, struct cell const * b)
+{
+    return a->len == b->len && a->attr == b->attr && memcmp(a->ch, b->ch, a->len) == 0;
+}
+
 void
 vt100_enable_raw_mode(int fd)
 {
@@ -22,26 +271,87 @@ vt100_enable_raw_mode(int fd)
     raw.c_oflag &= ~(OPOST);
     raw.c_cflag |= (CS8);
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    /* reads return at once, the render loop polls for keys */
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
 
     tcsetattr(fd, TCSAFLUSH, &raw);
 }
 
-enum vt100_key_type
-vt100_read_key(int fd)
+static char last_key_char = '\0';
+
+/* everything the terminal has is read at once and handed out one byte at a time */
+static char keys[64];
+static unsigned num_keys = 0;
+static unsigned key_idx = 0;
+
+/* Returns 1 and the next byte in 'c', 0 if the terminal has sent nothing more or -1 on error */
+static int
+read_key_byte(int fd, char * c)
+{
+    if (key_idx == num_keys) {
+        ssize_t ret;
+        do {
+            ret = read(fd, keys, sizeof(keys));
+        } while (ret < 0 && errno == EINTR);
+
+        if (ret < 0)
+            return errno == EAGAIN ? 0 : -1;
+
+        num_keys = ret;
+        key_idx = 0;
+
+        if (ret == 0)
+            return 0;
+    }
+
+    *c = keys[key_idx++];
+    return 1;
+}
+
+/*
+ * Keys such as the arrows send ESC [ or ESC O followed by more bytes. Such a sequence is
+ * read whole and is an unknown key, so none of its bytes are taken for keys of their own.
+ * An ESC that nothing else follows right away is the escape key.
+ */
+static enum vt100_key_type
+read_escape_sequence(int fd)
 {
     char c;
-    int ret = read(fd, &c, 1);
+    if (read_key_byte(fd, &c) <= 0)
+        return KEY_TYPE_ESCAPE;
 
-    if (ret == -1)
-        return KEY_TYPE_ERROR;
+    if (c != '[' && c != 'O') {
+        /* a key of its own, typed right after escape */
+        key_idx--;
+        return KEY_TYPE_ESCAPE;
+    }
+
+    last_key_char = '\0';
 
-    if (ret == 0)
-        return KEY_TYPE_NONE;
+    if (c == 'O') {
+        read_key_byte(fd, &c);
+        return KEY_TYPE_UNKNOWN;
+    }
 
-    if (ret != 1)
-        return KEY_TYPE_ERROR;
+    /* parameter and intermediate bytes, up to the final byte in 0x40-0x7e */
+    while (read_key_byte(fd, &c) > 0) {
+        if (c >= 0x40 && c <= 0x7e)
+            break;
+    }
+
+    return KEY_TYPE_UNKNOWN;
+}
+
+enum vt100_key_type
+vt100_read_key(int fd)
+{
+    char c;
+    int ret = read_key_byte(fd, &c);
+    if (ret <= 0)
+        return ret < 0 ? KEY_TYPE_ERROR : KEY_TYPE_NONE;
+
+    last_key_char = c;
 
     switch (c) {
     case 'q':
@@ -62,11 +372,27 @@ vt100_read_key(int fd)
     case 'e':
     case 'l':
         return KEY_TYPE_MOVE_DIFFS_RIGHT;
+    case ']':
+        return KEY_TYPE_NEXT_CHANGE;
+    case '[':
+        return KEY_TYPE_PREV_CHANGE;
+    case '/':
+        return KEY_TYPE_SEARCH;
+    case '?':
+        return KEY_TYPE_SEARCH_REGEX;
+    case '\x1b':
+        return read_escape_sequence(fd);
     default:
         return KEY_TYPE_UNKNOWN;
     }
 }
 
+char
+vt100_key_char(void)
+{
+    return last_key_char;
+}
+
 void
 vt100_disable_raw_mode(int fd)
 {
@@ -76,85 +402,95 @@ vt100_disable_raw_mode(int fd)
 void
 vt100_clear_screen(void)
 {
-    write(STDOUT_FILENO, "\x1b[2J", 4);
+    if (in_frame)
+        clear_cells(back);
+    else
+        out_append_str("\x1b[2J");
 }
 
 void
 vt100_hide_cursor(void)
 {
-    write(STDOUT_FILENO, "\x1b[?25l", 6);
+    out_append_str("\x1b[?25l");
 }
 
 void
 vt100_show_cursor(void)
 {
-    write(STDOUT_FILENO, "\x1b[?25h", 6);
+    out_append_str("\x1b[?25h");
 }
 
 void
 vt100_goto_top_left(void)
 {
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    out_append_str("\x1b[H");
 }
 
 void
 vt100_set_inverted_colors(void)
 {
     /* turn on reverse mode */
-    write(STDOUT_FILENO, "\x1b[7m", 4);
+    change_attr_str(0xff, ATTR_REVERSE, "\x1b[7m");
 }
 
 void
 vt100_set_default_colors(void)
 {
     /* turn off character attributes (such as reverse mode) */
-    write(STDOUT_FILENO, "\x1b[m", 3);
+    change_attr_str(0, 0, "\x1b[m");
 }
 
 void
 vt100_set_green_foreground(void)
 {
-    write(STDOUT_FILENO, "\x1b[32m", 5);
+    change_attr_str(~ATTR_FG_MASK, ATTR_FG_GREEN, "\x1b[32m");
 }
 
 void
 vt100_set_red_foreground(void)
 {
-    write(STDOUT_FILENO, "\x1b[31m", 5);
+    change_attr_str(~ATTR_FG_MASK, ATTR_FG_RED, "\x1b[31m");
 }
 
 void
 vt100_set_green_background(void)
 {
-    write(STDOUT_FILENO, "\x1b[m\x1b[42m", 8);
+    change_attr_str(0, ATTR_BG_GREEN, "\x1b[m\x1b[42m");
 }
 
 void
 vt100_set_red_background(void)
 {
-    write(STDOUT_FILENO, "\x1b[m\x1b[41m", 8);
+    change_attr_str(0, ATTR_BG_RED, "\x1b[m\x1b[41m");
 }
 
 void
 vt100_set_yellow_foreground(void)
 {
-    write(STDOUT_FILENO, "\x1b[33m", 5);
+    change_attr_str(~ATTR_FG_MASK, ATTR_FG_YELLOW, "\x1b[33m");
 }
 
 void
 vt100_set_underline(void)
 {
-    write(STDOUT_FILENO, "\x1b[4m", 4);
+    change_attr_str(0xff, ATTR_UNDERLINE, "\x1b[4m");
 }
 
 bool
 vt100_set_pos(int x, int y)
 {
-    /* max length: \x1b[150;150H<NULL> */
-    char a[14];
-    sprintf(a, "\x1b[%d;%dH", y, x);
-    int len = strlen(a);
-    write(STDOUT_FILENO, a, len);
+    if (in_frame) {
+        draw_x = x;
+        draw_y = y;
+        return true;
+    }
+
+    char a[32];
+    int len = snprintf(a, sizeof(a), "\x1b[%d;%dH", y, x);
+    if (len < 0 || len >= (int)sizeof(a))
+        return false;
+
+    out_append(a, len);
 
     return true;
 }
@@ -162,7 +498,10 @@ vt100_set_pos(int x, int y)
 void
 vt100_write(char const * data, unsigned len, unsigned max)
 {
-    write(STDOUT_FILENO, data, MIN(len, max));
+    if (in_frame)
+        draw_text(data, MIN(len, max));
+    else
+        out_append(data, MIN(len, max));
 }
 
 bool
@@ -183,11 +522,336 @@ vt100_get_window_size(struct vt100_dims * d)
 void
 vt100_leave_alternate_screen_buffer(void)
 {
-    write(STDOUT_FILENO, "\x1b[?1049l", 8);
+    out_append_str("\x1b[?1049l");
 }
 
 void
 vt100_enter_alternate_screen_buffer(void)
 {
-    write(STDOUT_FILENO, "\x1b[?1049h", 8);
+    out_append_str("\x1b[?1049h");
+}
+
+void
+vt100_flush(void)
+{
+    send_out(true);
+}
+
+/*
+ * Skipping a few unchanged cells costs more than sending them again. Only do so when they
+ * are plain characters that look the way the terminal draws right now.
+ */
+static bool
+resend_cells(struct cell const * cells, int n, uint8_t attr)
+{
+    if (n > 3)
+        return false;
+
+    for (int i = 0; i < n; ++i) {
+        if (cells[i].len != 1 || cells[i].attr != attr)
+            return false;
+    }
+
+    for (int i = 0; i < n; ++i)
+        out_append(cells[i].ch, 1);
+
+    return true;
+}
+
+/* How many cells of rows 'top' to 'bottom' (0-based) are right if the front moves up 'n' rows */
+static size_t
+count_matching_cells(int top, int bottom, int n)
+{
+    size_t matches = 0;
+    for (int row = top; row <= bottom; ++row) {
+        int src = row + n;
+        if (src < top || src > bottom)
+            continue;
+
+        struct cell const * b = &back[(size_t)row * grid_cols];
+        struct cell const * f = &front[(size_t)src * grid_cols];
+        for (int col = 0; col < grid_cols; ++col)
+            matches += cell_equal(&b[col], &f[col]);
+    }
+
+    return matches;
+}
+
+/*
+ * Let the terminal move rows 'top' to 'bottom' (0-based) up 'n' rows, or down if 'n' is
+ * negative, by setting a scroll region and indexing. The rows that scroll in are blank.
+ * Only done when that leaves fewer cells to send than drawing the rows in place.
+ */
+static void
+scroll_front(int top, int bottom, int n)
+{
+    int height = bottom - top + 1;
+    if (n == 0 || top < 0 || bottom >= grid_rows || abs(n) >= height)
+        return;
+
+    if (count_matching_cells(top, bottom, n) <= count_matching_cells(top, bottom, 0))
+        return;
+
+    char a[32];
+    int len = snprintf(a, sizeof(a), "\x1b[%d;%dr", top + 1, bottom + 1);
+    out_append(a, len);
+
+    /* index at the bottom margin scrolls up, reverse index at the top margin scrolls down */
+    vt100_set_pos(1, n > 0 ? bottom + 1 : top + 1);
+    for (int i = 0; i < abs(n); ++i) {
+        if (n > 0)
+            out_append_str("\x1b" "D");
+        else
+            out_append_str("\x1b" "M");
+    }
+
+    out_append_str("\x1b[r");
+
+    size_t moved = (size_t)(height - abs(n)) * grid_cols;
+    struct cell * region = &front[(size_t)top * grid_cols];
+    struct cell * blank;
+    if (n > 0) {
+        memmove(region, region + (size_t)n * grid_cols, moved * sizeof(*front));
+        blank = region + moved;
+    } else {
+        memmove(region + (size_t)-n * grid_cols, region, moved * sizeof(*front));
+        blank = region;
+    }
+
+    for (size_t i = 0, num = (size_t)abs(n) * grid_cols; i < num; ++i)
+        blank[i] = blank_cell;
+}
+
+void
+vt100_begin_frame(struct vt100_dims const * d)
+{
+    if (d->cols != grid_cols || d->rows != grid_rows) {
+        free(front);
+        free(back);
+
+        size_t n = (size_t)d->cols * d->rows;
+        front = malloc(n * sizeof(*front));
+        back = malloc(n * sizeof(*back));
+        if (front == NULL || back == NULL) {
+            free(front);
+            free(back);
+            front = back = NULL;
+            grid_cols = grid_rows = 0;
+
+            /* draw straight to the terminal like in the old days */
+            vt100_clear_screen();
+            return;
+        }
+
+        grid_cols = d->cols;
+        grid_rows = d->rows;
+        front_valid = false;
+    }
+
+    in_frame = true;
+    draw_x = draw_y = 1;
+    draw_attr = 0;
+    scroll_lines = 0;
+    clear_cells(back);
+}
+
+void
+vt100_scroll_rows(int top, int bottom, int n)
+{
+    if (!in_frame)
+        return;
+
+    scroll_top = top - 1;
+    scroll_bottom = bottom - 1;
+    scroll_lines = n;
+}
+
+void
+vt100_end_frame(void)
+{
+    if (!in_frame)
+        return;
+
+    in_frame = false;
+
+    /* after a resize we don't know what the terminal shows, start from an empty screen */
+    if (!front_valid) {
+        out_append_str("\x1b[m\x1b[2J");
+        clear_cells(front);
+        front_valid = true;
+    } else if (scroll_lines != 0) {
+        scroll_front(scroll_top, scroll_bottom, scroll_lines);
+    }
+
+    /* the cursor is where the last cell we sent ended, if we know that */
+    int x = 0, y = 0;
+    bool cursor_known = false;
+    uint8_t attr = 0;
+
+    for (int row = 0; row < grid_rows; ++row) {
+        for (int col = 0; col < grid_cols; ++col) {
+            size_t i = (size_t)row * grid_cols + col;
+            if (cell_equal(&back[i], &front[i]))
+                continue;
+
+            if (!cursor_known || y != row) {
+                vt100_set_pos(col + 1, row + 1);
+            } else if (x != col && !resend_cells(&back[i - (col - x)], col - x, attr)) {
+                char a[16];
+                int len = snprintf(a, sizeof(a), "\x1b[%dC", col - x);
+                out_append(a, len);
+            }
+
+            emit_attr(attr, back[i].attr);
+            attr = back[i].attr;
+
+            out_append(back[i].ch, back[i].len);
+            front[i] = back[i];
+
+            /* a wide character moves the cursor more than one column, so don't guess */
+            x = col + 1;
+            y = row;
+            cursor_known = back[i].len == 1 && x < grid_cols;
+        }
+    }
+
+    /* leave the terminal in its default state between frames */
+    emit_attr(attr, 0);
+}
+
+bool
+vt100_end_frame_as_text(int rows, bool colors)
+{
+    if (!in_frame)
+        return false;
+
+    in_frame = false;
+
+    for (int row = 0; row < MIN(rows, grid_rows); ++row) {
+        struct cell const * cells = &back[(size_t)row * grid_cols];
+
+        int end = grid_cols;
+        while (end > 0 && cell_equal(&cells[end - 1], &blank_cell))
+            --end;
+
+        uint8_t attr = 0;
+        for (int col = 0; col < end; ++col) {
+            struct cell const * c = &cells[col];
+            if (colors && c->attr != attr) {
+                emit_attr(attr, c->attr);
+                attr = c->attr;
+            }
+
+            /* a whole frame of text goes through here, one call per cell costs too much */
+            if (!out_buffer_reserve(&out, sizeof(c->ch))) {
+                out_append(c->ch, c->len);
+                continue;
+            }
+
+            memcpy(out.data + out.size, c->ch, sizeof(c->ch));
+            out.size += c->len;
+            pending_bytes += c->len;
+        }
+
+        emit_attr(attr, 0);
+        out_append_str("\n");
+    }
+
+    return true;
+}
+
+void
+vt100_flush_frame(void)
+{
+    send_out(false);
+
+    stats.frames++;
+    stats.bytes += pending_bytes;
+    stats.writes += pending_writes;
+    stats.max_frame_bytes = MAX(stats.max_frame_bytes, pending_bytes);
+    stats.max_frame_writes = MAX(stats.max_frame_writes, pending_writes);
+
+    pending_bytes = 0;
+    pending_writes = 0;
+}
+
+void
+vt100_get_frame_stats(struct vt100_frame_stats * s)
+{
+    *s = stats;
+}
+
+static void
+restore_out_flags(void)
+{
+    if (org_out_flags >= 0)
+        fcntl(STDOUT_FILENO, F_SETFL, (int)org_out_flags);
+}
+
+/* Put stdout back and die the way the signal would have had us die */
+static void
+catch_fatal_signal(int signo)
+{
+    restore_out_flags();
+
+    for (unsigned i = 0; i < NUM_FATAL_SIGNALS; ++i) {
+        if (fatal_signals[i] == signo)
+            sigaction(signo, &org_signal_actions[i], NULL);
+    }
+
+    raise(signo);
+}
+
+static void
+catch_fatal_signals(bool catch)
+{
+    static bool at_exit = false;
+    if (catch && !at_exit)
+        at_exit = atexit(restore_out_flags) == 0;
+
+    for (unsigned i = 0; i < NUM_FATAL_SIGNALS; ++i) {
+        if (catch) {
+            /* a signal that is ignored, such as SIGHUP under nohup, stays ignored */
+            struct sigaction sa = { .sa_handler = catch_fatal_signal };
+            sigemptyset(&sa.sa_mask);
+            signal_caught[i] = sigaction(fatal_signals[i], NULL, &org_signal_actions[i]) == 0
+                && org_signal_actions[i].sa_handler != SIG_IGN
+                && sigaction(fatal_signals[i], &sa, NULL) == 0;
+        } else if (signal_caught[i]) {
+            sigaction(fatal_signals[i], &org_signal_actions[i], NULL);
+            signal_caught[i] = false;
+        }
+    }
+}
+
+void
+vt100_set_async_output(bool async)
+{
+    if (async && org_out_flags < 0) {
+        int flags = fcntl(STDOUT_FILENO, F_GETFL);
+        if (flags >= 0) {
+            org_out_flags = flags;
+            catch_fatal_signals(true);
+            fcntl(STDOUT_FILENO, F_SETFL, flags | O_NONBLOCK);
+        }
+    } else if (!async) {
+        vt100_flush();
+
+        /* stdout is shared with the shell, which expects it the way it was */
+        restore_out_flags();
+        org_out_flags = -1;
+        catch_fatal_signals(false);
+    }
+}
+
+size_t
+vt100_queued(void)
+{
+    return out.size - out_sent;
+}
+
+void
+vt100_send_queued(void)
+{
+    send_out(false);
 }
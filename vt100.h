@@ -2,6 +2,7 @@
 #define _NADIFF_VT100_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 
 enum vt100_key_type {
     KEY_TYPE_NONE,
@@ -16,6 +17,9 @@ enum vt100_key_type {
     KEY_TYPE_MOVE_DIFFS_DOWN,
     KEY_TYPE_MOVE_DIFFS_LEFT,
     KEY_TYPE_MOVE_DIFFS_RIGHT,
+    KEY_TYPE_SEARCH, /* search for text */
+    KEY_TYPE_SEARCH_REGEX, /* search for a regular expression */
+    KEY_TYPE_ESCAPE,
 };
 
 struct vt100_dims {
@@ -23,12 +27,25 @@ struct vt100_dims {
     int cols;
 };
 
+struct vt100_frame_stats {
+    unsigned frames;
+    unsigned long long bytes;
+    unsigned long long writes;
+    size_t max_frame_bytes;
+    unsigned max_frame_writes;
+};
+
 void
 vt100_enable_raw_mode(int fd);
 
+/* Returns KEY_TYPE_NONE if no key is pending, it does not wait for one */
 enum vt100_key_type
 vt100_read_key(int fd);
 
+/* The character of the key that vt100_read_key() returned last, for typing in text */
+char
+vt100_key_char(void);
+
 void
 vt100_disable_raw_mode(int fd);
 
@@ -83,4 +100,57 @@ vt100_leave_alternate_screen_buffer(void);
 void
 vt100_enter_alternate_screen_buffer(void);
 
+/*
+ * A frame is drawn off-screen between these two. The screen starts out empty and when the
+ * frame ends, only what changed since the last frame is sent to the terminal.
+ */
+void
+vt100_begin_frame(struct vt100_dims const * d);
+
+void
+vt100_end_frame(void);
+
+/*
+ * End the frame by writing its first 'rows' rows out as lines of text instead, for output
+ * that is not a terminal. Blanks at the end of a row are left out, and so are the character
+ * attributes unless 'colors' is set. Returns false if there was no frame to end.
+ */
+bool
+vt100_end_frame_as_text(int rows, bool colors);
+
+/*
+ * Tell the frame being drawn that rows 'top' to 'bottom' show what the last frame showed 'n'
+ * rows further down, or up if 'n' is negative. The terminal is then asked to scroll those
+ * rows instead of having them drawn again.
+ */
+void
+vt100_scroll_rows(int top, int bottom, int n);
+
+/*
+ * Output is buffered until one of these is called. vt100_flush() waits until the terminal
+ * has taken everything. vt100_flush_frame() only writes what the terminal takes without
+ * blocking if output is asynchronous, and counts the frame in the frame stats.
+ */
+void
+vt100_flush(void);
+
+void
+vt100_flush_frame(void);
+
+/*
+ * Make stdout non-blocking, or restore it. While it is non-blocking, output the terminal
+ * has not taken stays queued until vt100_send_queued() is called.
+ */
+void
+vt100_set_async_output(bool async);
+
+size_t
+vt100_queued(void);
+
+void
+vt100_send_queued(void);
+
+void
+vt100_get_frame_stats(struct vt100_frame_stats * s);
+
 #endif